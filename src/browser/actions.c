@@ -474,29 +474,23 @@ static int *MakeMoveMapping(struct directory *dir, struct file_set *fs,
 	return result;
 }
 
-// TODO: This should be a VFS function.
 static void MoveEntries(struct directory *dir, struct file_set *fs,
                         unsigned int *insert_start)
 {
+	unsigned int *order;
 	int *new_index;
-	int i, j;
+	int i;
 
 	new_index = MakeMoveMapping(dir, fs, insert_start);
 
-	// Go through all entries. Each forms a chain of swaps to be
-	// followed until we end up back at the start.
+	// new_index maps from old to new positions; we need the inverse.
+	order = checked_calloc(dir->num_entries + 1, sizeof(unsigned int));
 	for (i = 0; i < dir->num_entries; i++) {
-		j = new_index[i];
-		while (j != i) {
-			int next_j;
-			VFS_SwapEntries(dir, i, j);
-			next_j = new_index[j];
-			// Don't swap again.
-			new_index[j] = j;
-			j = next_j;
-		}
+		order[new_index[i]] = i;
 	}
+	VFS_PermuteEntries(dir, order);
 
+	free(order);
 	free(new_index);
 }
 
@@ -565,47 +559,54 @@ const struct action rearrange_action = {
 	PerformRearrange,
 };
 
-static int CompareEntries(struct directory *dir, unsigned int i1,
-                          unsigned int i2)
+struct sort_entry {
+	const char *name;
+	unsigned int index;
+};
+
+static int CompareEntries(const void *x, const void *y)
 {
-	int cmp = strncmp(dir->entries[i1].name, dir->entries[i2].name, 8);
+	const struct sort_entry *ex = x, *ey = y;
+	int cmp = strncmp(ex->name, ey->name, 8);
 
 	// Fallback comparison preserves existing order.
 	if (cmp == 0) {
-		return i1 - i2;
+		return (ex->index > ey->index) - (ex->index < ey->index);
 	} else {
 		return cmp;
 	}
 }
 
-// TODO: This should be a VFS function.
-static void SortEntries(struct directory *dir, unsigned int *indexes,
-                        unsigned int count)
+// Reorders the entries at the given (ascending) indexes, either into
+// sorted order or reversing their current order.
+static void SortEntries(struct directory *dir, const unsigned int *indexes,
+                        unsigned int count, bool reverse)
 {
-	unsigned int i, pivot;
+	struct sort_entry *sorted;
+	unsigned int *order;
+	unsigned int i;
 
-	if (count < 2) {
-		return;
+	sorted = checked_calloc(count + 1, sizeof(struct sort_entry));
+	for (i = 0; i < count; i++) {
+		sorted[i].name = dir->entries[indexes[i]].name;
+		sorted[i].index = indexes[i];
+	}
+	if (!reverse) {
+		qsort(sorted, count, sizeof(struct sort_entry), CompareEntries);
 	}
 
-	// Pick pivot from middle (to avoid degenerate case if already sorted,
-	// and swap it to the start.
-	pivot = count / 2;
-	VFS_SwapEntries(dir, indexes[pivot], indexes[0]);
-	pivot = 0;
-
-	for (i = 1; i < count; i++) {
-		if (CompareEntries(dir, indexes[i], indexes[pivot]) < 0) {
-			// This belongs before the pivot.
-			VFS_SwapEntries(dir, indexes[i], indexes[pivot]);
-			++pivot;
-			// Swap back pivot into place
-			VFS_SwapEntries(dir, indexes[i], indexes[pivot]);
-		}
+	order = checked_calloc(dir->num_entries + 1, sizeof(unsigned int));
+	for (i = 0; i < dir->num_entries; i++) {
+		order[i] = i;
 	}
+	for (i = 0; i < count; i++) {
+		order[indexes[i]] =
+			sorted[reverse ? count - i - 1 : i].index;
+	}
+	VFS_PermuteEntries(dir, order);
 
-	SortEntries(dir, indexes, pivot);
-	SortEntries(dir, indexes + pivot + 1, count - pivot - 1);
+	free(order);
+	free(sorted);
 }
 
 static void PerformSortEntries(void)
@@ -639,7 +640,8 @@ static void PerformSortEntries(void)
 
 	// Check if already sorted.
 	for (i = 0; i < num_tagged - 1; i++) {
-		if (CompareEntries(dir, indexes[i], indexes[i + 1]) > 0) {
+		if (strncmp(dir->entries[indexes[i]].name,
+		            dir->entries[indexes[i + 1]].name, 8) > 0) {
 			break;
 		}
 	}
@@ -647,18 +649,14 @@ static void PerformSortEntries(void)
 	VFS_DescribeSet(dir, &active_pane->tagged, descr, sizeof(descr));
 
 	if (i < num_tagged - 1) {
-		SortEntries(dir, indexes, num_tagged);
+		SortEntries(dir, indexes, num_tagged, false);
 		UI_ShowNotice("%s sorted.", descr);
 	} else if (UI_ConfirmDialogBox("Sort", "Sort", "Cancel",
 	                               "%s already sorted.\nSort into "
 	                               "reverse order?", descr)) {
-		// Reverse sort doesn't even require using SortEntries(). The
-		// lumps are already sorted, so we just need to reverse
-		// them.
-		for (i = 0; i < num_tagged / 2; i++) {
-			VFS_SwapEntries(dir, indexes[i],
-			                indexes[num_tagged - i - 1]);
-		}
+		// Reverse sort doesn't need to compare anything. The lumps
+		// are already sorted, so we just need to reverse them.
+		SortEntries(dir, indexes, num_tagged, true);
 		UI_ShowNotice("%s reverse sorted.", descr);
 	}
 
@@ -755,9 +753,8 @@ static void PerformDeleteNoConfirm(void)
 {
 	struct directory *dir = active_pane->dir;
 	struct file_set *tagged = B_DirectoryPaneTagged(active_pane);
-	bool success = true;
+	bool success;
 	char buf[64];
-	int i;
 
 	if (tagged->num_entries == 0) {
 		UI_MessageBox("You have not selected anything to delete.");
@@ -774,18 +771,9 @@ static void PerformDeleteNoConfirm(void)
 
 	// Note that there's a corner-case gotcha here. VFS serial
 	// numbers for files are inode numbers, and through hardlinks
-	// multiple files can have the same inode number. However,
-	// the way things are implemented here, we only ever delete one
-	// of each serial number. So the wrong file can end up being
-	// deleted, but we'll never delete both.
-	for (i = 0; success && i < tagged->num_entries; i++) {
-		struct directory_entry *ent;
-		ent = VFS_EntryBySerial(dir, tagged->entries[i]);
-		if (ent == NULL) {
-			continue;
-		}
-		success = VFS_Remove(dir, ent);
-	}
+	// multiple files can have the same inode number. All of them
+	// will be deleted, but they are all shown as tagged too.
+	success = VFS_RemoveSet(dir, tagged);
 	if (success) {
 		VFS_CommitChanges(dir, "delete of %s", buf);
 		UI_ShowNotice("%s deleted.", buf);
@@ -915,7 +903,7 @@ static void CheckCompactWad(struct directory_pane *pane)
 {
 	struct wad_file *wf = VFS_WadFile(pane->dir);
 	const char *filename;
-	uint32_t junk_bytes_kb;
+	uint32_t junk_bytes_kb, bytes_saved;
 
 	if (wf == NULL) {
 		return;
@@ -933,12 +921,12 @@ static void CheckCompactWad(struct directory_pane *pane)
 	filename = PathBaseName(pane->dir->path);
 	if (!UI_ConfirmDialogBox(
 		"Compact WAD", "Compact", "Ignore",
-		"'%s' contains %dKB of junk data.\nCompact now?",
+		"'%s' contains %uKB of junk data.\nCompact now?",
 		filename, junk_bytes_kb)) {
 		return;
 	}
-	if (W_CompactWAD(wf)) {
-		UI_ShowNotice("WAD compacted; %dKB saved.", junk_bytes_kb);
+	if (W_CompactWAD(wf, W_COMPACT_OUT_OF_PLACE, &bytes_saved)) {
+		UI_ShowNotice("WAD compacted; %uKB saved.", bytes_saved / 1000);
 	} else {
 		UI_MessageBox("Error when compacting '%s'.", filename);
 	}
@@ -1066,7 +1054,7 @@ static void PerformCompact(void)
 	struct directory_entry *ent;
 	struct directory *wad_dir;
 	struct wad_file *wf;
-	uint32_t junk_bytes;
+	uint32_t bytes_saved;
 	int selected;
 
 	selected = B_DirectoryPaneSelected(active_pane);
@@ -1099,26 +1087,30 @@ static void PerformCompact(void)
 		goto fail;
 	}
 
-	junk_bytes = W_NumJunkBytes(wf);
-	if (junk_bytes == 0) {
-		UI_ShowNotice("'%s' cannot be made any smaller.", ent->name);
-		goto fail;
-	}
+	// We don't say how much will be saved: even with no junk, the WAD
+	// may still contain duplicate lumps that can be merged, and we only
+	// find out about those while compacting.
 	if (!UI_ConfirmDialogBox("Compact WAD", "Compact", "Cancel",
-	                         "'%s' contains %d junk bytes.\n"
-	                         "Compact WAD? This operation cannot\n"
-	                         "be undone.", ent->name, junk_bytes)) {
+	                         "Compact '%s' and merge\n"
+	                         "duplicate lumps? This operation\n"
+	                         "cannot be undone.", ent->name)) {
 		goto fail;
 	}
 	if (!B_CheckReadOnly(wad_dir)) {
 		goto fail;
 	}
-	if (!W_CompactWAD(wf)) {
+	if (!W_CompactWAD(wf, W_COMPACT_MERGE_DUPLICATES | W_COMPACT_OUT_OF_PLACE,
+	                  &bytes_saved)) {
 		UI_MessageBox("Failed to compact '%s'.", ent->name);
 		goto fail;
 	}
+	// Nothing is changed if the WAD could not be made any smaller.
+	if (bytes_saved == 0) {
+		UI_ShowNotice("'%s' cannot be made any smaller.", ent->name);
+		goto fail;
+	}
 
-	UI_ShowNotice("WAD compacted; %dKB saved.", junk_bytes / 1000);
+	UI_ShowNotice("WAD compacted; %uKB saved.", bytes_saved / 1000);
 
 	VFS_Refresh(wad_dir);
 	VFS_Refresh(active_pane->dir);
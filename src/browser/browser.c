@@ -623,6 +623,36 @@ static void InitSearchPane(WINDOW *win)
 	UI_TextInputInit(&search_pane.input, win, 256);
 }
 
+// Called from the main loop when something changes in a watched
+// directory. The panes keep the same entries selected where they can.
+static void DirectoriesChanged(void)
+{
+	struct directory_pane *p;
+	uint64_t serial_nos[2];
+	bool selected[2];
+	int i, idx;
+
+	for (i = 0; i < 2; i++) {
+		p = browser_panes[i];
+		idx = B_DirectoryPaneSelected(p);
+		selected[i] = idx >= 0 && idx < p->dir->num_entries;
+		if (selected[i]) {
+			serial_nos[i] = p->dir->entries[idx].serial_no;
+		}
+	}
+
+	VFS_PollWatches();
+	VFS_RefreshAll();
+
+	for (i = 0; i < 2; i++) {
+		B_DirectoryPaneReselect(browser_panes[i]);
+		if (selected[i]) {
+			B_DirectoryPaneSelectBySerial(browser_panes[i],
+			                              serial_nos[i]);
+		}
+	}
+}
+
 void B_Shutdown(void)
 {
 	TF_RestoreOldPalette();
@@ -673,4 +703,6 @@ void B_Init(const char *path1, const char *path2)
 	B_SwitchToPane(browser_panes[0]);
 
 	SetWindowSizes();
+
+	UI_SetWatchHandler(VFS_WatchFd(), DirectoriesChanged);
 }
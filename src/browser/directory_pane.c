@@ -16,7 +16,9 @@
 #include <string.h>
 #include <strings.h>
 
+#include "common.h"
 #include "ui/colors.h"
+#include "fs/wad_file.h"
 #include "stringlib.h"
 #include "ui/pane.h"
 
@@ -254,13 +256,13 @@ struct file_set *B_DirectoryPaneTagged(struct directory_pane *p)
 	} else {
 		static struct file_set result;
 		int selected = B_DirectoryPaneSelected(p);
+		// The set may have been modified since the last call, in
+		// which case it now owns a copy of its array.
+		VFS_FreeSet(&result);
 		if (selected >= 0) {
 			// Some devious pointer magic here.
 			result.entries = &p->dir->entries[selected].serial_no;
 			result.num_entries = 1;
-		} else {
-			result.entries = NULL;
-			result.num_entries = 0;
 		}
 		return &result;
 	}
@@ -295,11 +297,33 @@ struct directory_entry *B_DirectoryPaneEntry(struct directory_pane *p)
 	return &p->dir->entries[selected];
 }
 
+// The info pane shows the header of the selected lump. Load the headers
+// for everything on screen in one go, so that moving the cursor through
+// them doesn't read them from the file one at a time.
+static void LoadVisibleHeaders(struct directory_pane *dp)
+{
+	struct wad_file *wf = VFS_WadFile(dp->dir);
+	int first, last;
+
+	if (wf == NULL) {
+		return;
+	}
+
+	first = (int) dp->pane.window_offset - HeaderEntries(dp);
+	last = first + UI_ListPaneLines(&dp->pane);
+	first = max(first, 0);
+	last = min(last, (int) dp->dir->num_entries);
+	if (first < last) {
+		W_LoadLumpHeaders(wf, first, last - first);
+	}
+}
+
 static bool DrawPane(void *p)
 {
 	struct directory_pane *dp = p;
 	WINDOW *win = dp->pane.pane.window;
 	int x, w, space;
+	LoadVisibleHeaders(dp);
 	UI_ListPaneDraw(p);
 
 	w = getmaxx(win);
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "common.h"
 #include "conv/audio.h"
 #include "conv/error.h"
 #include "ui/dialog.h"
@@ -26,6 +27,7 @@
 #include "ui/title_bar.h"
 #include "fs/vfile.h"
 #include "fs/vfs.h"
+#include "fs/wad_file.h"
 #include "palette/palette.h"
 
 struct lump_type;
@@ -140,7 +142,31 @@ static const struct lump_type *IdentifyLumpType(struct directory *dir,
 	wf = VFS_WadFile(dir);
 	idx = ent - dir->entries;
 
-	return LI_IdentifyLump(wf, idx);
+	return LI_IdentifyLumpDeep(wf, idx);
+}
+
+// Identifying lumps needs their headers and the start of their data, so
+// identify them all up front in a single pass through the file instead of
+// one at a time. Only the tagged lumps are read, in position order.
+static void PreloadLumpTypes(struct directory *dir, struct file_set *set)
+{
+	struct directory_entry *ent;
+	unsigned int *indexes;
+	size_t num_indexes = 0;
+	int idx = 0;
+
+	if (dir->type != FILE_TYPE_WAD) {
+		return;
+	}
+
+	indexes = checked_calloc(set->num_entries + 1, sizeof(unsigned int));
+	while ((ent = VFS_IterateSet(dir, set, &idx)) != NULL) {
+		indexes[num_indexes] = ent - dir->entries;
+		++num_indexes;
+	}
+
+	LI_IdentifyLumpsDeep(VFS_WadFile(dir), indexes, num_indexes);
+	free(indexes);
 }
 
 static char *FileNameForEntry(const struct lump_type *lt,
@@ -169,6 +195,7 @@ static bool ConfirmOverwrite(struct directory *from, struct file_set *from_set,
 	int i;
 
 	VFS_Refresh(to);
+	PreloadLumpTypes(from, from_set);
 
 	for (i = 0; i < from_set->num_entries; i++) {
 		ent = VFS_EntryBySerial(from, from_set->entries[i]);
@@ -298,6 +325,8 @@ bool PerformExport(struct directory *from, struct file_set *from_set,
 	char *filename, *filename2;
 	struct directory_entry *ent, *ent2;
 	struct progress_window progress;
+	uint64_t *exported, *created;
+	size_t num_exported, num_created;
 	bool success;
 	int idx;
 
@@ -329,17 +358,31 @@ bool PerformExport(struct directory *from, struct file_set *from_set,
 
 	VFS_Refresh(to);
 
+	// The sets are updated in bulk at the end, rather than one
+	// entry at a time.
+	exported = checked_calloc(from_set->num_entries + 1, sizeof(uint64_t));
+	created = checked_calloc(from_set->num_entries + 1, sizeof(uint64_t));
+	num_exported = 0;
+	num_created = 0;
+
 	idx = 0;
 	while ((ent = VFS_IterateSet(from, from_set, &idx)) != NULL) {
 		const struct lump_type *lt = IdentifyLumpType(from, ent);
-		VFS_RemoveFromSet(from_set, ent->serial_no);
+		exported[num_exported] = ent->serial_no;
+		++num_exported;
 		filename = FileNameForEntry(lt, ent, convert);
 		ent2 = VFS_EntryByName(to, filename);
 		free(filename);
 		if (ent2 != NULL) {
-			VFS_AddToSet(result, ent2->serial_no);
+			created[num_created] = ent2->serial_no;
+			++num_created;
 		}
 	}
 
+	VFS_RemoveAllFromSet(from_set, exported, num_exported);
+	VFS_AddAllToSet(result, created, num_created);
+	free(exported);
+	free(created);
+
 	return true;
 }
@@ -315,6 +315,41 @@ static int TransparencyColor(const struct patch_header *hdr,
 	return 0;
 }
 
+// Checks the column offset table at the start of a patch. Only the first
+// buf_len bytes of the lump need to be in buf, but the table must fit in
+// them. Every offset must point after the table and inside the lump,
+// which is lump_len bytes long.
+bool V_CheckPatchColumns(const uint8_t *buf, size_t buf_len,
+                         size_t lump_len)
+{
+	struct patch_header hdr;
+	size_t table_end;
+	uint32_t off;
+	int x;
+
+	if (buf_len < sizeof(struct patch_header)) {
+		return false;
+	}
+	memcpy(&hdr, buf, sizeof(struct patch_header));
+	V_SwapPatchHeader(&hdr);
+
+	table_end = sizeof(struct patch_header) + hdr.width * 4;
+	if (table_end > buf_len || table_end > lump_len) {
+		return false;
+	}
+
+	for (x = 0; x < hdr.width; x++) {
+		memcpy(&off, buf + sizeof(struct patch_header) + x * 4,
+		       sizeof(uint32_t));
+		SwapLE32(&off);
+		if (off < table_end || off >= lump_len) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static bool ValidatePatch(const struct patch_header *hdr,
                           const uint8_t *srcbuf, size_t srcbuf_len)
 {
@@ -323,15 +358,14 @@ static bool ValidatePatch(const struct patch_header *hdr,
 	uint32_t off;
 	int x;
 
+	if (!V_CheckPatchColumns(srcbuf, srcbuf_len, srcbuf_len)) {
+		ConversionError("Corrupted patch: invalid column offsets");
+		return false;
+	}
+
 	for (x = 0; x < hdr->width; ++x) {
 		off = columnofs[x];
 		SwapLE32(&off);
-		if (off > srcbuf_len - 1) {
-			ConversionError("Corrupted patch: column %d has "
-			                "invalid offset %d > %d",
-			                x, off, srcbuf_len - 1);
-			return false;
-		}
 		while (srcbuf[off] != 0xff) {
 			if (off >= srcbuf_len - 2
 			 || off + srcbuf[off + 1] + 4 >= srcbuf_len) {
@@ -346,7 +380,7 @@ static bool ValidatePatch(const struct patch_header *hdr,
 	return true;
 }
 
-static void DrawPatch(const struct patch_header *hdr, uint8_t *srcbuf,
+static void DrawPatch(const struct patch_header *hdr, const uint8_t *srcbuf,
                       size_t srcbuf_len, uint8_t *dstbuf, int trans_color)
 {
 	uint32_t *columnofs =
@@ -377,17 +411,18 @@ static void DrawPatch(const struct patch_header *hdr, uint8_t *srcbuf,
 
 VFILE *V_ToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf, *imgbuf = NULL;
+	const uint8_t *buf;
+	uint8_t *imgbuf = NULL;
 	struct patch_header hdr;
 	size_t buf_len;
 	bool has_transparency;
 	int transparent_color = 0;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
-	if (buf_len < 6) {
-		ConversionError("Patch too short: %d < 6", (int) buf_len);
+	buf = vfborrow(input, &buf_len);
+	if (buf_len < sizeof(struct patch_header)) {
+		ConversionError("Patch too short: %d < %d", (int) buf_len,
+		                (int) sizeof(struct patch_header));
 		goto fail;
 	}
 
@@ -410,20 +445,19 @@ VFILE *V_ToImageFile(VFILE *input, const struct palette *pal)
 
 fail:
 	free(imgbuf);
-	free(buf);
+	vfclose(input);
 
 	return result;
 }
 
 VFILE *V_FlatToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf;
+	const uint8_t *buf;
 	struct patch_header hdr;
 	size_t buf_len;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
+	buf = vfborrow(input, &buf_len);
 
 	// Most flats are 64x64, but Heretic/Hexen animated ones are larger.
 	if (buf_len < 4096 || (buf_len % 64) != 0) {
@@ -438,7 +472,7 @@ VFILE *V_FlatToImageFile(VFILE *input, const struct palette *pal)
 	result = V_WritePalettizedPNG(&hdr, buf, pal, false, 0);
 
 fail:
-	free(buf);
+	vfclose(input);
 
 	return result;
 }
@@ -446,13 +480,12 @@ fail:
 // For Hexen fullscreen images.
 VFILE *V_FullscreenToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf;
+	const uint8_t *buf;
 	struct patch_header hdr;
 	size_t buf_len;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
+	buf = vfborrow(input, &buf_len);
 	assert(buf_len == FULLSCREEN_SZ);
 
 	hdr.width = FULLSCREEN_W;
@@ -460,7 +493,7 @@ VFILE *V_FullscreenToImageFile(VFILE *input, const struct palette *pal)
 	hdr.topoffset = 0;
 	hdr.leftoffset = 0;
 	result = V_WritePalettizedPNG(&hdr, buf, pal, false, 0);
-	free(buf);
+	vfclose(input);
 
 	return result;
 }
@@ -11,6 +11,7 @@
 #ifndef CONV__GRAPHIC_H_INCLUDED
 #define CONV__GRAPHIC_H_INCLUDED
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "fs/vfile.h"
@@ -31,5 +32,7 @@ VFILE *V_FullscreenToImageFile(VFILE *input, const struct palette *pal);
 VFILE *V_FullscreenFromImageFile(VFILE *input, const struct palette *pal);
 VFILE *V_HiresToImageFile(VFILE *input);
 void V_SwapPatchHeader(struct patch_header *hdr);
+bool V_CheckPatchColumns(const uint8_t *buf, size_t buf_len,
+                         size_t lump_len);
 
 #endif /* #ifndef CONV__GRAPHIC_H_INCLUDED */
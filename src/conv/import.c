@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <strings.h>
 
+#include "common.h"
 #include "conv/audio.h"
 #include "conv/error.h"
 #include "conv/graphic.h"
@@ -156,23 +157,34 @@ static VFILE *PerformConversion(VFILE *input, struct directory *to_wad,
 	return input;
 }
 
-bool ImportFromFile(VFILE *from_file, const char *src_name,
-                    struct directory *to_wad, int lumpnum, bool convert)
+static VFILE *OpenForImport(VFILE *from_file, const char *src_name,
+                            struct directory *to_wad, bool convert)
 {
-	VFILE *to_lump;
-
 	if (convert) {
 		from_file = PerformConversion(from_file, to_wad, src_name);
 	}
 	if (from_file == NULL) {
 		ConversionError("Failed conversion for '%s'", src_name);
+	}
+	return from_file;
+}
+
+bool ImportFromFile(VFILE *from_file, const char *src_name,
+                    struct directory *to_wad, int lumpnum, bool convert)
+{
+	bool success;
+
+	from_file = OpenForImport(from_file, src_name, to_wad, convert);
+	if (from_file == NULL) {
 		return false;
 	}
 
-	to_lump = W_OpenLumpRewrite(VFS_WadFile(to_wad), lumpnum);
-	vfcopy(from_file, to_lump);
+	success = W_WriteLumpFrom(VFS_WadFile(to_wad), lumpnum, from_file);
 	vfclose(from_file);
-	vfclose(to_lump);
+	if (!success) {
+		ConversionError("Error writing '%s' to WAD", src_name);
+		return false;
+	}
 	return true;
 }
 
@@ -184,9 +196,13 @@ bool PerformImport(struct directory *from, struct file_set *from_set,
 	struct directory_entry *ent;
 	struct wad_file *to_wad;
 	struct wad_file_entry *waddir;
+	struct wad_batch *batch;
 	struct progress_window progress;
+	uint64_t *added, *imported;
+	size_t num_imported = 0;
 	char namebuf[9];
 	int idx, lumpnum;
+	bool success = true;
 
 	UI_InitProgressWindow(
 		&progress, from_set->num_entries,
@@ -204,6 +220,15 @@ bool PerformImport(struct directory *from, struct file_set *from_set,
 	// We only ever do conversions when importing from files.
 	convert = convert && from->type == FILE_TYPE_DIR;
 
+	// The sets are updated in one go at the end, rather than one entry
+	// at a time.
+	added = checked_calloc(from_set->num_entries + 1, sizeof(uint64_t));
+	imported = checked_calloc(from_set->num_entries + 1, sizeof(uint64_t));
+
+	// All the new lumps are written as a single batch, so that the
+	// data for them is written out in a few large writes.
+	batch = W_BeginBatch(to_wad);
+
 	idx = 0;
 	while ((ent = VFS_IterateSet(from, from_set, &idx)) != NULL) {
 
@@ -211,20 +236,42 @@ bool PerformImport(struct directory *from, struct file_set *from_set,
 		W_SetLumpName(to_wad, lumpnum, namebuf);
 
 		from_file = VFS_OpenByEntry(from, ent);
+		from_file = OpenForImport(from_file, ent->name, to, convert);
+		if (from_file == NULL) {
+			success = false;
+			break;
+		}
 
-		if (!ImportFromFile(from_file, ent->name, to, lumpnum,
-		                    convert)) {
-			VFS_Rollback(to);
-			return false;
+		success = W_BatchWriteLump(batch, lumpnum, from_file);
+		vfclose(from_file);
+		if (!success) {
+			ConversionError("Error writing '%s' to WAD", ent->name);
+			break;
 		}
 
-		VFS_AddToSet(result, waddir[lumpnum].serial_no);
+		added[num_imported] = waddir[lumpnum].serial_no;
+		imported[num_imported] = ent->serial_no;
+		++num_imported;
 		++lumpnum;
 
-		VFS_RemoveFromSet(from_set, ent->serial_no);
 		UI_UpdateProgressWindow(&progress, ent->name);
 	}
 
+	if (!W_EndBatch(batch) && success) {
+		ConversionError("Error writing lumps to WAD");
+		success = false;
+	}
+
+	VFS_AddAllToSet(result, added, num_imported);
+	VFS_RemoveAllFromSet(from_set, imported, num_imported);
+	free(added);
+	free(imported);
+
+	if (!success) {
+		VFS_Rollback(to);
+		return false;
+	}
+
 	VFS_Refresh(to);
 	return true;
 }
@@ -52,13 +52,12 @@ VFILE *V_PaletteToImageFile(VFILE *input)
 
 VFILE *V_ColormapToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf;
+	const uint8_t *buf;
 	struct patch_header hdr;
 	size_t buf_len;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
+	buf = vfborrow(input, &buf_len);
 
 	if (buf_len % 256 != 0) {
 		ConversionError("Invalid colormap length: %d is not a "
@@ -73,7 +72,7 @@ VFILE *V_ColormapToImageFile(VFILE *input, const struct palette *pal)
 	result = V_WritePalettizedPNG(&hdr, buf, pal, false, 0);
 
 fail:
-	free(buf);
+	vfclose(input);
 
 	return result;
 }
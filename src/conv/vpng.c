@@ -28,6 +28,11 @@
 #include "png.h"
 #include "pngconf.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNEL
+#endif
+
 #define OFFSET_CHUNK_NAME  "grAb"
 
 struct offsets_chunk {
@@ -42,19 +47,244 @@ static void SwapOffsetsChunk(struct offsets_chunk *chunk)
 	SwapBE32(&chunk->topoffset);
 }
 
-static uint8_t FindColor(const struct palette *pal, int r, int g, int b)
+// Nearest colour searches are accelerated by dividing the RGB cube into
+// cells and listing, for each cell, the palette entries that could be the
+// nearest match for some colour inside it. Usually only a handful of
+// entries need to be checked instead of all 256. Cell lists are built
+// when first needed and kept for as long as we keep palettizing against
+// the same palette, which is the common case for a bulk import.
+#define CELL_BITS       3
+#define CELL_SIZE       (1 << CELL_BITS)
+#define CELLS_PER_AXIS  (256 >> CELL_BITS)
+#define NUM_CELLS       (CELLS_PER_AXIS * CELLS_PER_AXIS * CELLS_PER_AXIS)
+
+struct color_lookup {
+	struct palette palette;
+	// The palette again, one array per channel, for the SIMD kernel.
+	int16_t channels[3][256];
+	// Offset into candidates[] of the list for each cell, or -1 if the
+	// list has not been built yet.
+	int cell_start[NUM_CELLS];
+	uint16_t cell_count[NUM_CELLS];
+	uint8_t *candidates;
+	size_t num_candidates, candidates_alloced;
+	int (*cell_distances)(const struct color_lookup *lu, const int lo[3],
+	                      const int hi[3], int min_dist[256]);
+};
+
+static struct color_lookup *color_lookup;
+
+static int AxisMinDist(int v, int lo, int hi)
+{
+	return v < lo ? lo - v : v > hi ? v - hi : 0;
+}
+
+static int AxisMaxDist(int v, int lo, int hi)
+{
+	return v - lo > hi - v ? v - lo : hi - v;
+}
+
+// Fills in min_dist[] with the squared distance from each palette entry
+// to the closest point of the cell bounded by lo[] and hi[], and returns
+// the smallest squared distance from any entry to the furthest point.
+static int CellDistances(const struct color_lookup *lu, const int lo[3],
+                         const int hi[3], int min_dist[256])
+{
+	const struct palette_entry *e;
+	int max_dist, bound = INT_MAX, i, d;
+
+	for (i = 0; i < 256; i++) {
+		e = &lu->palette.entries[i];
+		d = AxisMinDist(e->r, lo[0], hi[0]);
+		min_dist[i] = d * d;
+		d = AxisMinDist(e->g, lo[1], hi[1]);
+		min_dist[i] += d * d;
+		d = AxisMinDist(e->b, lo[2], hi[2]);
+		min_dist[i] += d * d;
+
+		d = AxisMaxDist(e->r, lo[0], hi[0]);
+		max_dist = d * d;
+		d = AxisMaxDist(e->g, lo[1], hi[1]);
+		max_dist += d * d;
+		d = AxisMaxDist(e->b, lo[2], hi[2]);
+		max_dist += d * d;
+		if (max_dist < bound) {
+			bound = max_dist;
+		}
+	}
+
+	return bound;
+}
+
+#ifdef HAVE_SSE2_KERNEL
+
+// Squared length of the vectors whose components are in the low (or high)
+// four 16-bit lanes of v[0..2], as 32-bit values.
+static inline __attribute__((target("sse2")))
+__m128i SumSquares(const __m128i v[3], bool high)
+{
+	__m128i zero = _mm_setzero_si128(), rg, b;
+
+	if (high) {
+		rg = _mm_unpackhi_epi16(v[0], v[1]);
+		b = _mm_unpackhi_epi16(v[2], zero);
+	} else {
+		rg = _mm_unpacklo_epi16(v[0], v[1]);
+		b = _mm_unpacklo_epi16(v[2], zero);
+	}
+
+	return _mm_add_epi32(_mm_madd_epi16(rg, rg), _mm_madd_epi16(b, b));
+}
+
+static inline __attribute__((target("sse2")))
+__m128i Min32(__m128i a, __m128i b)
+{
+	__m128i lt = _mm_cmplt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(lt, a), _mm_andnot_si128(lt, b));
+}
+
+// Same as CellDistances(), but eight palette entries at a time. Every
+// intermediate value is exact, so the result is identical.
+static __attribute__((target("sse2")))
+int CellDistancesSSE2(const struct color_lookup *lu, const int lo[3],
+                      const int hi[3], int min_dist[256])
+{
+	__m128i zero = _mm_setzero_si128(), bound = _mm_set1_epi32(INT_MAX);
+	__m128i vlo[3], vhi[3], v, mn[3], mx[3];
+	int bounds[4], result, i, c;
+
+	for (c = 0; c < 3; c++) {
+		vlo[c] = _mm_set1_epi16(lo[c]);
+		vhi[c] = _mm_set1_epi16(hi[c]);
+	}
+
+	for (i = 0; i < 256; i += 8) {
+		for (c = 0; c < 3; c++) {
+			v = _mm_loadu_si128(
+				(const __m128i *) &lu->channels[c][i]);
+			mn[c] = _mm_add_epi16(
+				_mm_max_epi16(_mm_sub_epi16(vlo[c], v), zero),
+				_mm_max_epi16(_mm_sub_epi16(v, vhi[c]), zero));
+			mx[c] = _mm_max_epi16(_mm_sub_epi16(v, vlo[c]),
+			                      _mm_sub_epi16(vhi[c], v));
+		}
+		_mm_storeu_si128((__m128i *) &min_dist[i],
+		                 SumSquares(mn, false));
+		_mm_storeu_si128((__m128i *) &min_dist[i + 4],
+		                 SumSquares(mn, true));
+		bound = Min32(bound, SumSquares(mx, false));
+		bound = Min32(bound, SumSquares(mx, true));
+	}
+
+	_mm_storeu_si128((__m128i *) bounds, bound);
+	result = bounds[0];
+	for (i = 1; i < 4; i++) {
+		if (bounds[i] < result) {
+			result = bounds[i];
+		}
+	}
+
+	return result;
+}
+
+#endif
+
+// An entry can only be the nearest match for some colour in the cell if
+// its distance to the closest point of the cell is no more than the
+// furthest that any colour in the cell can be from the best-placed entry.
+// Ties are kept, and the list stays in palette order, so that searching
+// it gives exactly the same answer as searching the whole palette.
+static void BuildCell(struct color_lookup *lu, int cell)
+{
+	int min_dist[256], bound;
+	int lo[3], hi[3], i;
+
+	lo[0] = (cell / (CELLS_PER_AXIS * CELLS_PER_AXIS)) << CELL_BITS;
+	lo[1] = ((cell / CELLS_PER_AXIS) % CELLS_PER_AXIS) << CELL_BITS;
+	lo[2] = (cell % CELLS_PER_AXIS) << CELL_BITS;
+	for (i = 0; i < 3; i++) {
+		hi[i] = lo[i] + CELL_SIZE - 1;
+	}
+
+	bound = lu->cell_distances(lu, lo, hi, min_dist);
+
+	if (lu->num_candidates + 256 > lu->candidates_alloced) {
+		lu->candidates_alloced = lu->candidates_alloced < 4096 ?
+		                         4096 : lu->candidates_alloced * 2;
+		lu->candidates = checked_realloc(
+			lu->candidates, lu->candidates_alloced);
+	}
+
+	lu->cell_start[cell] = lu->num_candidates;
+	for (i = 0; i < 256; i++) {
+		if (min_dist[i] <= bound) {
+			lu->candidates[lu->num_candidates] = i;
+			++lu->num_candidates;
+		}
+	}
+	lu->cell_count[cell] = lu->num_candidates - lu->cell_start[cell];
+}
+
+// Returns the lookup structure for the given palette, throwing away the
+// old one if the palette has changed since we were last called.
+static struct color_lookup *LookupForPalette(const struct palette *pal)
 {
-	int diff, best_diff = INT_MAX, i, best_idx = -1;
+	struct color_lookup *lu = color_lookup;
+	int i;
+
+	if (lu != NULL && !memcmp(&lu->palette, pal, sizeof(struct palette))) {
+		return lu;
+	}
+
+	if (lu == NULL) {
+		lu = checked_calloc(1, sizeof(struct color_lookup));
+		lu->cell_distances = CellDistances;
+#ifdef HAVE_SSE2_KERNEL
+		if (__builtin_cpu_supports("sse2")) {
+			lu->cell_distances = CellDistancesSSE2;
+		}
+#endif
+		color_lookup = lu;
+	}
 
+	memcpy(&lu->palette, pal, sizeof(struct palette));
 	for (i = 0; i < 256; i++) {
-		diff = (r - pal->entries[i].r) * (r - pal->entries[i].r)
-		     + (g - pal->entries[i].g) * (g - pal->entries[i].g)
-		     + (b - pal->entries[i].b) * (b - pal->entries[i].b);
+		lu->channels[0][i] = pal->entries[i].r;
+		lu->channels[1][i] = pal->entries[i].g;
+		lu->channels[2][i] = pal->entries[i].b;
+	}
+	for (i = 0; i < NUM_CELLS; i++) {
+		lu->cell_start[i] = -1;
+	}
+	lu->num_candidates = 0;
+
+	return lu;
+}
+
+static uint8_t FindColor(struct color_lookup *lu, int r, int g, int b)
+{
+	const struct palette_entry *e;
+	const uint8_t *candidates;
+	int diff, best_diff = INT_MAX, i, best_idx = -1, cell, count;
+
+	cell = ((r >> CELL_BITS) * CELLS_PER_AXIS + (g >> CELL_BITS))
+	     * CELLS_PER_AXIS + (b >> CELL_BITS);
+	if (lu->cell_start[cell] < 0) {
+		BuildCell(lu, cell);
+	}
+	candidates = &lu->candidates[lu->cell_start[cell]];
+	count = lu->cell_count[cell];
+
+	for (i = 0; i < count; i++) {
+		e = &lu->palette.entries[candidates[i]];
+		diff = (r - e->r) * (r - e->r)
+		     + (g - e->g) * (g - e->g)
+		     + (b - e->b) * (b - e->b);
 		if (diff == 0) {
-			return i;
+			return candidates[i];
 		}
 		if (diff < best_diff) {
-			best_idx = i;
+			best_idx = candidates[i];
 			best_diff = diff;
 		}
 	}
@@ -65,7 +295,9 @@ static uint8_t FindColor(const struct palette *pal, int r, int g, int b)
 uint8_t *V_PalettizeRGBABuffer(const struct palette *pal, uint8_t *buf,
                                size_t rowstep, int width, int height)
 {
-	uint8_t *result, *pixel;
+	struct color_lookup *lu = LookupForPalette(pal);
+	uint8_t *result, *pixel, last_color = 0;
+	uint32_t rgb, last_rgb = UINT32_MAX;
 	int x, y;
 
 	result = checked_calloc(width, height);
@@ -73,8 +305,15 @@ uint8_t *V_PalettizeRGBABuffer(const struct palette *pal, uint8_t *buf,
 	for (y = 0; y < height; ++y) {
 		for (x = 0; x < width; ++x) {
 			pixel = &buf[y * rowstep + x * 4];
-			result[y * width + x] = FindColor(
-				pal, pixel[0], pixel[1], pixel[2]);
+			// Runs of the same colour are common, so don't search
+			// again for a colour we just looked up.
+			rgb = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+			if (rgb != last_rgb) {
+				last_color = FindColor(
+					lu, pixel[0], pixel[1], pixel[2]);
+				last_rgb = rgb;
+			}
+			result[y * width + x] = last_color;
 		}
 	}
 
@@ -307,7 +546,7 @@ static png_color *MakePNGPalette(const struct palette *palette)
 	return result;
 }
 
-VFILE *V_WritePalettizedPNG(struct patch_header *hdr, uint8_t *imgbuf,
+VFILE *V_WritePalettizedPNG(struct patch_header *hdr, const uint8_t *imgbuf,
                             const struct palette *palette,
                             bool set_transparency, int transparent_color)
 {
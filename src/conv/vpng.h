@@ -35,7 +35,7 @@ VFILE *V_OpenPNGWrite(struct png_context *ctx);
 void V_ClosePNG(struct png_context *ctx);
 
 uint8_t *V_ReadRGBAPNG(VFILE *input, struct patch_header *hdr, int *rowstep);
-VFILE *V_WritePalettizedPNG(struct patch_header *hdr, uint8_t *imgbuf,
+VFILE *V_WritePalettizedPNG(struct patch_header *hdr, const uint8_t *imgbuf,
                             const struct palette *palette,
                             bool set_transparency, int transparent_color);
 
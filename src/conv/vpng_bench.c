@@ -0,0 +1,205 @@
+//
+// Copyright(C) 2024 Simon Howard
+//
+// You can redistribute and/or modify this program under the terms of
+// the GNU General Public License version 2 as published by the Free
+// Software Foundation, or any later version. This program is
+// distributed WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+
+// Standalone check and benchmark for the palette lookup in vpng.c.
+// The cell distance kernels are static, so the whole file is included
+// here rather than linked. Built with "make vpng_bench".
+
+#include "conv/vpng.c"
+
+#include <stdbool.h>
+#include <time.h>
+
+#define DEFAULT_PALETTES  50
+#define CHECK_PIXELS      (256 * 256)
+
+static uint32_t rand_state = 0x12345678;
+
+static uint32_t Random(void)
+{
+	// xorshift32; we want the same palettes on every run.
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Palette number n: the Doom palette first, then one with lots of
+// duplicate entries so that ties get exercised, then random ones.
+static void MakePalette(int n, struct palette *pal)
+{
+	int i;
+
+	if (n == 0) {
+		memcpy(pal, &doom_palette, sizeof(struct palette));
+		return;
+	}
+	for (i = 0; i < 256; i++) {
+		if (n == 1) {
+			pal->entries[i].r = (i / 16) * 17;
+			pal->entries[i].g = (i / 16) * 17;
+			pal->entries[i].b = (i % 4) * 85;
+		} else {
+			pal->entries[i].r = Random() & 0xff;
+			pal->entries[i].g = Random() & 0xff;
+			pal->entries[i].b = Random() & 0xff;
+		}
+	}
+}
+
+static void CellBounds(int cell, int lo[3], int hi[3])
+{
+	int i;
+
+	lo[0] = (cell / (CELLS_PER_AXIS * CELLS_PER_AXIS)) << CELL_BITS;
+	lo[1] = ((cell / CELLS_PER_AXIS) % CELLS_PER_AXIS) << CELL_BITS;
+	lo[2] = (cell % CELLS_PER_AXIS) << CELL_BITS;
+	for (i = 0; i < 3; i++) {
+		hi[i] = lo[i] + CELL_SIZE - 1;
+	}
+}
+
+// Runs the given kernel over every cell, returning the time taken.
+static double TimeKernel(const struct color_lookup *lu,
+                         int (*kernel)(const struct color_lookup *lu,
+                                       const int lo[3], const int hi[3],
+                                       int min_dist[256]))
+{
+	int min_dist[256], lo[3], hi[3], cell;
+	volatile int sink = 0;
+	double start = Now();
+
+	for (cell = 0; cell < NUM_CELLS; cell++) {
+		CellBounds(cell, lo, hi);
+		sink += kernel(lu, lo, hi, min_dist);
+	}
+
+	return Now() - start;
+}
+
+#ifdef HAVE_SSE2_KERNEL
+static bool CompareKernels(int n, const struct color_lookup *lu)
+{
+	int min_dist1[256], min_dist2[256], bound1, bound2;
+	int lo[3], hi[3], cell, i;
+
+	for (cell = 0; cell < NUM_CELLS; cell++) {
+		CellBounds(cell, lo, hi);
+		bound1 = CellDistances(lu, lo, hi, min_dist1);
+		bound2 = CellDistancesSSE2(lu, lo, hi, min_dist2);
+		if (bound1 != bound2) {
+			fprintf(stderr, "palette %d, cell %d: bound %d != %d\n",
+			        n, cell, bound1, bound2);
+			return false;
+		}
+		for (i = 0; i < 256; i++) {
+			if (min_dist1[i] != min_dist2[i]) {
+				fprintf(stderr, "palette %d, cell %d: "
+				        "min_dist[%d] %d != %d\n", n, cell,
+				        i, min_dist1[i], min_dist2[i]);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+#endif
+
+// The lookup must give exactly the same answers as the old search of
+// the whole palette, including which entry wins a tie.
+static bool ComparePalettize(int n, const struct palette *pal)
+{
+	const struct palette_entry *e;
+	uint8_t *buf, *result;
+	int i, j, diff, best_diff, best_idx;
+	bool ok = true;
+
+	buf = checked_malloc(CHECK_PIXELS * 4);
+	for (i = 0; i < CHECK_PIXELS * 4; i++) {
+		buf[i] = Random() & 0xff;
+	}
+
+	result = V_PalettizeRGBABuffer(pal, buf, 256 * 4, 256,
+	                               CHECK_PIXELS / 256);
+
+	for (i = 0; i < CHECK_PIXELS && ok; i++) {
+		best_diff = INT_MAX;
+		best_idx = -1;
+		for (j = 0; j < 256; j++) {
+			e = &pal->entries[j];
+			diff = (buf[i * 4] - e->r) * (buf[i * 4] - e->r)
+			     + (buf[i * 4 + 1] - e->g) * (buf[i * 4 + 1] - e->g)
+			     + (buf[i * 4 + 2] - e->b) * (buf[i * 4 + 2] - e->b);
+			if (diff < best_diff) {
+				best_idx = j;
+				best_diff = diff;
+			}
+		}
+		if (result[i] != best_idx) {
+			fprintf(stderr, "palette %d, pixel %d: got %d, "
+			        "expected %d\n", n, i, result[i], best_idx);
+			ok = false;
+		}
+	}
+
+	free(buf);
+	free(result);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	struct palette pal;
+	struct color_lookup *lu;
+	double scalar_time = 0, sse2_time = 0;
+	int num_palettes = DEFAULT_PALETTES, n;
+
+	if (argc > 1) {
+		num_palettes = atoi(argv[1]);
+	}
+
+	for (n = 0; n < num_palettes; n++) {
+		MakePalette(n, &pal);
+		lu = LookupForPalette(&pal);
+
+		scalar_time += TimeKernel(lu, CellDistances);
+#ifdef HAVE_SSE2_KERNEL
+		if (__builtin_cpu_supports("sse2")) {
+			if (!CompareKernels(n, lu)) {
+				return 1;
+			}
+			sse2_time += TimeKernel(lu, CellDistancesSSE2);
+		}
+#endif
+		if (!ComparePalettize(n, &pal)) {
+			return 1;
+		}
+	}
+
+	printf("%d palettes, %d cells each\n", num_palettes, NUM_CELLS);
+	printf("CellDistances:     %.3fs\n", scalar_time);
+	if (sse2_time > 0) {
+		printf("CellDistancesSSE2: %.3fs (%.1fx)\n", sse2_time,
+		       scalar_time / sse2_time);
+	} else {
+		printf("CellDistancesSSE2: not available\n");
+	}
+
+	return 0;
+}
@@ -27,6 +27,18 @@ static unsigned int SearchForTag(struct file_set *l, uint64_t serial_no)
 {
 	unsigned int min = 0, max = l->num_entries;
 
+	// When the set is a single contiguous run of serial numbers (as
+	// when everything in a WAD is tagged), the index can be calculated
+	// directly. Any gap in the run means a binary search instead.
+	if (max > 0 && l->entries[max - 1] - l->entries[0] == max - 1) {
+		if (serial_no < l->entries[0]) {
+			return 0;
+		} else if (serial_no - l->entries[0] >= max) {
+			return max;
+		}
+		return serial_no - l->entries[0];
+	}
+
 	while (min < max) {
 		unsigned int midpoint;
 		uint64_t test_serial;
@@ -44,6 +56,29 @@ static unsigned int SearchForTag(struct file_set *l, uint64_t serial_no)
 	return min;
 }
 
+static void EnsureAlloced(struct file_set *l, size_t count)
+{
+	uint64_t *new_entries;
+	size_t new_alloced;
+
+	if (count <= l->alloced) {
+		return;
+	}
+
+	new_alloced = max(count, max(l->alloced * 2, 16));
+	if (l->alloced > 0 || l->entries == NULL) {
+		l->entries = checked_realloc(l->entries,
+		                             new_alloced * sizeof(uint64_t));
+	} else {
+		// The set does not own its array, so make a copy.
+		new_entries = checked_calloc(new_alloced, sizeof(uint64_t));
+		memcpy(new_entries, l->entries,
+		       l->num_entries * sizeof(uint64_t));
+		l->entries = new_entries;
+	}
+	l->alloced = new_alloced;
+}
+
 void VFS_AddToSet(struct file_set *l, uint64_t serial_no)
 {
 	unsigned int entries_index = SearchForTag(l, serial_no);
@@ -54,8 +89,7 @@ void VFS_AddToSet(struct file_set *l, uint64_t serial_no)
 		return;
 	}
 
-	l->entries = checked_realloc(l->entries,
-		sizeof(uint64_t) * (l->num_entries + 1));
+	EnsureAlloced(l, l->num_entries + 1);
 	memmove(&l->entries[entries_index + 1], &l->entries[entries_index],
 	        sizeof(uint64_t) * (l->num_entries - entries_index));
 	l->entries[entries_index] = serial_no;
@@ -83,17 +117,23 @@ struct directory_entry *VFS_AddGlobToSet(
 	struct directory *dir, struct file_set *l, const char *glob)
 {
 	struct directory_entry *ent, *result = NULL;
+	uint64_t *matches;
+	size_t num_matches = 0;
 	int i = 0;
 
+	matches = checked_calloc(dir->num_entries + 1, sizeof(uint64_t));
 	for (i = 0; i < dir->num_entries; ++i) {
 		ent = &dir->entries[i];
 		if (ent->type != FILE_TYPE_DIR && GlobMatch(glob, ent->name)) {
-			VFS_AddToSet(l, ent->serial_no);
+			matches[num_matches] = ent->serial_no;
+			++num_matches;
 			if (result == NULL) {
 				result = ent;
 			}
 		}
 	}
+	VFS_AddAllToSet(l, matches, num_matches);
+	free(matches);
 	return result;
 }
 
@@ -121,19 +161,122 @@ bool VFS_SetHas(struct file_set *l, uint64_t serial_no)
 }
 
 
+static int CompareSerials(const void *x, const void *y)
+{
+	uint64_t sx = *(const uint64_t *) x, sy = *(const uint64_t *) y;
+
+	return (sx > sy) - (sx < sy);
+}
+
+// Returns a sorted copy of the given serial numbers, without duplicates.
+static uint64_t *SortedSerials(const uint64_t *serial_nos, size_t *count)
+{
+	uint64_t *result;
+	size_t i, n = 0;
+	bool sorted = true;
+
+	result = checked_calloc(*count + 1, sizeof(uint64_t));
+	memcpy(result, serial_nos, *count * sizeof(uint64_t));
+
+	for (i = 1; sorted && i < *count; i++) {
+		sorted = result[i - 1] < result[i];
+	}
+	if (sorted) {
+		return result;
+	}
+
+	qsort(result, *count, sizeof(uint64_t), CompareSerials);
+	for (i = 0; i < *count; i++) {
+		if (n == 0 || result[n - 1] != result[i]) {
+			result[n] = result[i];
+			++n;
+		}
+	}
+	*count = n;
+	return result;
+}
+
+void VFS_AddAllToSet(struct file_set *l, const uint64_t *serial_nos,
+                     size_t count)
+{
+	uint64_t *adds, *merged;
+	size_t i = 0, j = 0, n = 0;
+
+	if (count == 0) {
+		return;
+	}
+
+	adds = SortedSerials(serial_nos, &count);
+	merged = checked_calloc(l->num_entries + count, sizeof(uint64_t));
+
+	while (i < l->num_entries || j < count) {
+		if (j >= count
+		 || (i < l->num_entries && l->entries[i] < adds[j])) {
+			merged[n] = l->entries[i];
+			++i;
+		} else {
+			if (i < l->num_entries && l->entries[i] == adds[j]) {
+				++i;
+			}
+			merged[n] = adds[j];
+			++j;
+		}
+		++n;
+	}
+
+	free(adds);
+	VFS_FreeSet(l);
+	l->entries = merged;
+	l->num_entries = n;
+	l->alloced = n;
+}
+
+void VFS_RemoveAllFromSet(struct file_set *l, const uint64_t *serial_nos,
+                          size_t count)
+{
+	uint64_t *removes;
+	size_t i, j = 0, n = 0;
+
+	if (count == 0 || l->num_entries == 0) {
+		return;
+	}
+
+	// We filter in place, so we need our own copy of the array.
+	EnsureAlloced(l, l->num_entries);
+	removes = SortedSerials(serial_nos, &count);
+
+	for (i = 0; i < l->num_entries; i++) {
+		while (j < count && removes[j] < l->entries[i]) {
+			++j;
+		}
+		if (j >= count || removes[j] != l->entries[i]) {
+			l->entries[n] = l->entries[i];
+			++n;
+		}
+	}
+	l->num_entries = n;
+
+	free(removes);
+}
+
 void VFS_CopySet(struct file_set *to, struct file_set *from)
 {
 	to->num_entries = from->num_entries;
-	to->entries = checked_calloc(to->num_entries, sizeof(uint64_t));
+	to->alloced = from->num_entries + 1;
+	to->entries = checked_calloc(to->alloced, sizeof(uint64_t));
 	memcpy(to->entries, from->entries,
 	       to->num_entries * sizeof(uint64_t));
 }
 
 void VFS_FreeSet(struct file_set *set)
 {
-	free(set->entries);
+	// A set that does not own its array must not free it.
+	if (set->alloced > 0) {
+		free(set->entries);
+	}
 	set->entries = NULL;
 	set->num_entries = 0;
+	set->alloced = 0;
 }
 
 struct directory_entry *VFS_IterateSet(struct directory *dir,
@@ -16,12 +16,21 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <strings.h>
+#include <fcntl.h>
 
 #include "common.h"
 #include "stringlib.h"
 #include "fs/vfs.h"
 #include "fs/vfile.h"
 
+struct real_directory {
+	struct directory dir;
+	// inotify watch on the directory, or -1 if we can't watch it, in
+	// which case every refresh rescans the directory.
+	int watch;
+	unsigned int last_changes;
+};
+
 static int HasWadExtension(const char *name)
 {
 	const char *extn;
@@ -44,11 +53,39 @@ static int OrderByName(const void *x, const void *y)
 	return strcasecmp(dx->name, dy->name);
 }
 
+// Fills in the type and size of a directory entry. Where the directory
+// listing already tells us that something is a directory, there is no need
+// to stat() it; otherwise we stat() the file, which resolves symlinks and
+// gives the file size (in a portable way).
+static void StatEntry(int dfd, struct dirent *dirent,
+                      struct directory_entry *ent)
+{
+	struct stat s;
+	bool stat_ok;
+
+#ifdef DT_DIR
+	if (dirent->d_type == DT_DIR) {
+		ent->type = FILE_TYPE_DIR;
+		ent->size = -1;
+		return;
+	}
+#endif
+
+	stat_ok = fstatat(dfd, dirent->d_name, &s, 0) == 0;
+	ent->type = stat_ok && S_ISDIR(s.st_mode) ? FILE_TYPE_DIR :
+	            HasWadExtension(ent->name) ? FILE_TYPE_WAD :
+	            FILE_TYPE_FILE;
+	ent->size = stat_ok
+	         && ent->type != FILE_TYPE_DIR ? s.st_size : -1;
+}
+
 static bool _RealDirRefresh(struct directory *d,
                             struct directory_entry **entries,
                             size_t *num_entries)
 {
 	DIR *dir;
+	size_t entries_alloced = 0;
+	int dfd;
 
 	*entries = NULL;
 	*num_entries = 0;
@@ -57,13 +94,11 @@ static bool _RealDirRefresh(struct directory *d,
 	if (dir == NULL) {
 		return false;
 	}
+	dfd = dirfd(dir);
 
 	for (;;) {
 		struct dirent *dirent = readdir(dir);
 		struct directory_entry *ent;
-		struct stat s;
-		bool stat_ok;
-		char *path;
 
 		if (dirent == NULL) {
 			break;
@@ -71,23 +106,16 @@ static bool _RealDirRefresh(struct directory *d,
 		if (dirent->d_name[0] == '.') {
 			continue;
 		}
-		path = StringJoin("/", d->path, dirent->d_name, NULL);
-		// We stat() the file, which resolves symlinks and gives
-		// additional information such as file size and type
-		// (in a portable way)
-		stat_ok = stat(path, &s) == 0;
-		free(path);
-		path = checked_strdup(dirent->d_name);
 
-		*entries = checked_realloc(*entries,
-			sizeof(struct directory_entry) * (*num_entries + 1));
+		if (*num_entries >= entries_alloced) {
+			entries_alloced = entries_alloced < 64 ?
+			                  64 : entries_alloced * 2;
+			*entries = checked_realloc(*entries,
+				sizeof(struct directory_entry) * entries_alloced);
+		}
 		ent = *entries + *num_entries;
-		ent->name = path;
-		ent->type = stat_ok && S_ISDIR(s.st_mode) ? FILE_TYPE_DIR :
-		            HasWadExtension(ent->name) ? FILE_TYPE_WAD :
-		            FILE_TYPE_FILE;
-		ent->size = stat_ok
-		         && ent->type != FILE_TYPE_DIR ? s.st_size : -1;
+		ent->name = VFS_AllocEntryName(d, dirent->d_name, SIZE_MAX);
+		StatEntry(dfd, dirent, ent);
 		ent->serial_no = dirent->d_ino;
 		++*num_entries;
 	}
@@ -105,6 +133,26 @@ static void RealDirRefresh(void *d, struct directory_entry **entries,
 	(void) _RealDirRefresh(d, entries, num_entries);
 }
 
+// Only rescan the directory if its watch has seen something change.
+static void RealDirRefreshChanges(void *_dir, struct vfs_refresh_diff *diff)
+{
+	struct real_directory *dir = _dir;
+	unsigned int changes;
+
+	if (dir->watch >= 0) {
+		changes = VFS_WatchChanges(dir->watch);
+		if (changes == dir->last_changes) {
+			diff->start = -1;
+			diff->removed = 0;
+			diff->added = 0;
+			return;
+		}
+		dir->last_changes = changes;
+	}
+
+	VFS_RefreshAllEntries(&dir->dir, diff);
+}
+
 static VFILE *RealDirOpen(void *_dir, struct directory_entry *entry)
 {
 	struct directory *dir = _dir;
@@ -173,24 +221,36 @@ static bool RealDirRename(void *_dir, struct directory_entry *entry,
 	return result;
 }
 
+static void RealDirFree(void *_dir)
+{
+	struct real_directory *dir = _dir;
+
+	VFS_Unwatch(dir->watch);
+}
+
 static const struct directory_funcs realdir_funcs = {
 	"file", "files",
 	RealDirRefresh,
+	RealDirRefreshChanges,
 	RealDirOpen,
 	RealDirOpenDir,
 	RealDirRemove,
+	NULL,  // remove_entries
 	RealDirRename,
 	NULL,  // need_commit
 	NULL,  // commit
 	NULL,  // swap_entries
+	NULL,  // permute_entries
 	NULL,  // save_snapshot
 	NULL,  // restore_snapshot
-	NULL,  // free
+	RealDirFree,
 };
 
 struct directory *VFS_OpenRealDir(const char *path)
 {
-	struct directory *d = checked_calloc(1, sizeof(struct directory));
+	struct real_directory *dir =
+		checked_calloc(1, sizeof(struct real_directory));
+	struct directory *d = &dir->dir;
 
 	d->directory_funcs = &realdir_funcs;
 	VFS_InitDirectory(d, path);
@@ -199,6 +259,10 @@ struct directory *VFS_OpenRealDir(const char *path)
 		free(d->parent_name);
 		d->parent_name = NULL;
 	}
+	// The watch goes in before the first scan, so that nothing that
+	// changes while we scan can be missed.
+	dir->watch = VFS_WatchPath(path);
+	dir->last_changes = VFS_WatchChanges(dir->watch);
 	if (!_RealDirRefresh(d, &d->entries, &d->num_entries)) {
 		VFS_CloseDir(d);
 		return NULL;
@@ -13,10 +13,18 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "fs/vfile.h"
 
+// Block size used by vfcopy() and vfreadall().
+#define COPY_BLOCK_SIZE  (32 * 1024)
+
+// Size of the buffer used to coalesce small writes to a mapped file.
+#define WRITE_BUFFER_SIZE  (16 * 1024)
+
 struct _VFILE {
 	const struct vfile_functions *functions;
 	void *handle;
@@ -24,6 +32,8 @@ struct _VFILE {
 	void *onclose_data;
 	VFILE_CONTEXT local_ctx;
 	VFILE_CONTEXT *current_ctx, *last_ctx;
+	// Buffer returned by vfborrow(), freed on close.
+	void *borrowed;
 };
 
 VFILE *vfopen(void *handle, struct vfile_functions *funcs)
@@ -99,9 +109,18 @@ void vfclose(VFILE *stream)
 		stream->onclose(stream, stream->onclose_data);
 	}
 	stream->functions->close(stream->handle);
+	free(stream->borrowed);
 	free(stream);
 }
 
+long vfsize(VFILE *stream)
+{
+	if (stream->functions->size == NULL) {
+		return -1;
+	}
+	return stream->functions->size(stream->handle);
+}
+
 void vfonclose(VFILE *stream, void (*callback)(VFILE *, void *), void *data)
 {
 	stream->onclose = callback;
@@ -145,6 +164,18 @@ static void wrapped_fclose(void *handle)
 	fclose(handle);
 }
 
+// This is only a hint; there may be buffered writes that have not
+// reached the file yet, hence checking the current position too.
+static long wrapped_fsize(void *handle)
+{
+	struct stat s;
+
+	if (fstat(fileno((FILE *) handle), &s) != 0) {
+		return -1;
+	}
+	return max((long) s.st_size, ftell(handle));
+}
+
 static struct vfile_functions wrapped_io_functions = {
 	wrapped_fread,
 	wrapped_fwrite,
@@ -153,6 +184,7 @@ static struct vfile_functions wrapped_io_functions = {
 	wrapped_ftruncate,
 	wrapped_fclose,
 	wrapped_fsync,
+	wrapped_fsize,
 };
 
 VFILE *vfwrapfile(FILE *stream)
@@ -183,6 +215,7 @@ struct restricted_vfile {
 static size_t restricted_vfread(void *ptr, size_t size, size_t nitems, void *handle)
 {
 	struct restricted_vfile *restricted = handle;
+	const struct vfile_functions *inner_funcs = restricted->inner->functions;
 	size_t nreadable, result;
 
 	if (restricted->end >= 0) {
@@ -196,8 +229,14 @@ static size_t restricted_vfread(void *ptr, size_t size, size_t nitems, void *han
 		return 0;
 	}
 
-	WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
-		result = vfread(ptr, size, nitems, restricted->inner));
+	if (inner_funcs->pread != NULL) {
+		result = inner_funcs->pread(ptr, size * nitems,
+		                            restricted->start + restricted->pos,
+		                            restricted->inner->handle) / size;
+	} else {
+		WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
+			result = vfread(ptr, size, nitems, restricted->inner));
+	}
 	if (result < 0) {
 		return -1;
 	}
@@ -210,6 +249,7 @@ static size_t restricted_fwrite(const void *ptr, size_t size,
                                 size_t nitems, void *handle)
 {
 	struct restricted_vfile *restricted = handle;
+	const struct vfile_functions *inner_funcs = restricted->inner->functions;
 	size_t nwriteable, result;
 
 	if (restricted->ro) {
@@ -227,8 +267,14 @@ static size_t restricted_fwrite(const void *ptr, size_t size,
 		return 0;
 	}
 
-	WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
-		result = vfwrite(ptr, size, nitems, restricted->inner));
+	if (inner_funcs->pwrite != NULL) {
+		result = inner_funcs->pwrite(ptr, size * nitems,
+		                             restricted->start + restricted->pos,
+		                             restricted->inner->handle) / size;
+	} else {
+		WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
+			result = vfwrite(ptr, size, nitems, restricted->inner));
+	}
 	if (result < 0) {
 		return -1;
 	}
@@ -251,13 +297,17 @@ static int restricted_vfseek(void *handle, long offset, int whence)
 		return -1;
 	}
 
-	WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
-		result = vfseek(restricted->inner, adjusted_offset, whence));
-
-	if (result < 0) {
-		return -1;
+	// With positional I/O there is no inner position to keep in sync.
+	if (restricted->inner->functions->pread == NULL) {
+		WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
+			result = vfseek(restricted->inner,
+			                adjusted_offset, whence));
+		if (result < 0) {
+			return -1;
+		}
 	}
 
+	restricted->pos = offset;
 	return 0;
 }
 
@@ -280,6 +330,21 @@ static void restricted_vfsync(void *handle)
 		vfsync(restricted->inner));
 }
 
+static long restricted_vfsize(void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	long inner_size;
+
+	if (restricted->end >= 0) {
+		return restricted->end - restricted->start;
+	}
+	inner_size = vfsize(restricted->inner);
+	if (inner_size < 0) {
+		return -1;
+	}
+	return max(inner_size - restricted->start, 0);
+}
+
 static void restricted_vfclose(void *handle)
 {
 	struct restricted_vfile *restricted = handle;
@@ -297,13 +362,25 @@ static struct vfile_functions restricted_io_functions = {
 	restricted_vftruncate,
 	restricted_vfclose,
 	restricted_vfsync,
+	restricted_vfsize,
 };
 
+static VFILE *MappedView(VFILE *inner, long start, long end);
+
 // Create restricted file slice starting at given offset. end=-1 mean no limit
 VFILE *vfrestrict(VFILE *inner, long start, long end, int ro)
 {
 	VFILE *result;
 	struct restricted_vfile *restricted;
+
+	// Read-only slices of a memory-mapped file can just borrow the
+	// mapped pages, with no need to go through the inner file at all.
+	if (ro && end >= 0) {
+		result = MappedView(inner, start, end);
+		if (result != NULL) {
+			return result;
+		}
+	}
 	restricted = checked_calloc(1, sizeof(struct restricted_vfile));
 	restricted->inner = inner;
 	restricted->start = start;
@@ -322,7 +399,10 @@ VFILE *vfrestrict(VFILE *inner, long start, long end, int ro)
 
 struct memory_vfile {
 	uint8_t *buf;
-	size_t buf_len, pos;
+	size_t buf_len, buf_alloced, pos;
+	// If non-NULL, buf is borrowed from this memory-mapped file and
+	// the view is read-only.
+	struct mapped_vfile *owner;
 };
 
 static size_t memory_vfread(void *ptr, size_t size, size_t nitems, void *handle)
@@ -347,8 +427,17 @@ static size_t memory_vfwrite(const void *ptr, size_t size,
 	size_t num_bytes = size * nitems;
 	size_t new_pos = f->pos + num_bytes;
 
+	if (f->owner != NULL) {
+		return 0;
+	}
+
+	// Grow geometrically so that a series of small writes does not
+	// reallocate the buffer every time.
+	if (new_pos > f->buf_alloced) {
+		f->buf_alloced = max(new_pos, f->buf_alloced * 2);
+		f->buf = checked_realloc(f->buf, f->buf_alloced);
+	}
 	if (new_pos > f->buf_len) {
-		f->buf = checked_realloc(f->buf, new_pos);
 		f->buf_len = new_pos;
 	}
 
@@ -392,17 +481,31 @@ static void memory_vftruncate(void *handle)
 {
 	struct memory_vfile *f = handle;
 
-	f->buf_len = f->pos;
+	if (f->owner == NULL) {
+		f->buf_len = f->pos;
+	}
 }
 
 static void memory_vfsync(void *handle)
 {
 }
 
+static long memory_vfsize(void *handle)
+{
+	struct memory_vfile *f = handle;
+	return f->buf_len;
+}
+
+static void UnrefMapping(struct mapped_vfile *m);
+
 static void memory_vfclose(void *handle)
 {
 	struct memory_vfile *f = handle;
-	free(f->buf);
+	if (f->owner != NULL) {
+		UnrefMapping(f->owner);
+	} else {
+		free(f->buf);
+	}
 	free(f);
 }
 
@@ -414,6 +517,7 @@ static struct vfile_functions memory_io_functions = {
 	memory_vftruncate,
 	memory_vfclose,
 	memory_vfsync,
+	memory_vfsize,
 };
 
 VFILE *vfopenmem(const void *buf, size_t buf_len)
@@ -421,9 +525,12 @@ VFILE *vfopenmem(const void *buf, size_t buf_len)
 	struct memory_vfile *memfile;
 	memfile = checked_calloc(1, sizeof(struct memory_vfile));
 	memfile->buf = checked_malloc(buf_len);
-	memcpy(memfile->buf, buf, buf_len);
+	if (buf_len > 0) {
+		memcpy(memfile->buf, buf, buf_len);
+	}
 	memfile->pos = 0;
 	memfile->buf_len = buf_len;
+	memfile->buf_alloced = buf_len;
 	return vfopen(memfile, &memory_io_functions);
 }
 
@@ -441,11 +548,307 @@ bool vfgetbuf(VFILE *f, void **buf, size_t *buf_len)
 	return true;
 }
 
+// The mapped file backend works directly on a file descriptor using
+// positional I/O (pread/pwrite) with its own file position, so
+// restricted slices of it can read and write concurrently with no shared
+// seek state. The file is also memory-mapped, so that read-only slices
+// created with vfrestrict() can be served directly from the mapped pages
+// without any system calls or copying at all.
+struct mapped_vfile {
+	int fd;
+	long pos;
+	uint8_t *map;
+	size_t map_len;
+	// Number of open views borrowing the current mapping. We can only
+	// replace the mapping when there are none.
+	int num_views;
+	// Small writes to consecutive offsets (eg. a structure being written
+	// one field at a time) are collected here and written out together.
+	// The buffer is flushed before anything reads the file.
+	uint8_t write_buf[WRITE_BUFFER_SIZE];
+	long write_buf_start;
+	size_t write_buf_len;
+};
+
+static size_t WriteAll(struct mapped_vfile *m, const void *ptr,
+                       size_t nbytes, long offset)
+{
+	size_t total = 0;
+	ssize_t result;
+
+	while (total < nbytes) {
+		result = pwrite(m->fd, (const uint8_t *) ptr + total,
+		                nbytes - total, offset + total);
+		if (result <= 0) {
+			break;
+		}
+		total += result;
+	}
+
+	return total;
+}
+
+// Like with stdio, an error writing out buffered data is not reported
+// back to the caller that wrote it.
+static void FlushWrites(struct mapped_vfile *m)
+{
+	if (m->write_buf_len > 0) {
+		WriteAll(m, m->write_buf, m->write_buf_len,
+		         m->write_buf_start);
+		m->write_buf_len = 0;
+	}
+}
+
+static void Unmap(struct mapped_vfile *m)
+{
+	if (m->map != NULL) {
+		munmap(m->map, m->map_len);
+	}
+	m->map = NULL;
+	m->map_len = 0;
+}
+
+// Ensure the mapping covers the given end offset, remapping if the file
+// has grown since it was last mapped.
+static bool MapRange(struct mapped_vfile *m, size_t end)
+{
+	struct stat s;
+	void *map;
+
+	FlushWrites(m);
+	if (end <= m->map_len) {
+		return true;
+	}
+	if (m->num_views > 0 || fstat(m->fd, &s) != 0 || s.st_size < end) {
+		return false;
+	}
+
+	Unmap(m);
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, m->fd, 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	m->map = map;
+	m->map_len = s.st_size;
+	return true;
+}
+
+static void UnrefMapping(struct mapped_vfile *m)
+{
+	assert(m->num_views > 0);
+	--m->num_views;
+}
+
+static size_t mapped_vfpread(void *ptr, size_t nbytes, long offset,
+                             void *handle)
+{
+	struct mapped_vfile *m = handle;
+	size_t total = 0;
+	ssize_t result;
+
+	FlushWrites(m);
+	while (total < nbytes) {
+		result = pread(m->fd, (uint8_t *) ptr + total,
+		               nbytes - total, offset + total);
+		if (result <= 0) {
+			break;
+		}
+		total += result;
+	}
+
+	return total;
+}
+
+static size_t mapped_vfpwrite(const void *ptr, size_t nbytes, long offset,
+                              void *handle)
+{
+	struct mapped_vfile *m = handle;
+
+	// Only a write that carries on from the end of the buffered data
+	// can be added to it.
+	if (m->write_buf_len > 0
+	 && (offset != m->write_buf_start + m->write_buf_len
+	  || m->write_buf_len + nbytes > WRITE_BUFFER_SIZE)) {
+		FlushWrites(m);
+	}
+	if (nbytes >= WRITE_BUFFER_SIZE) {
+		return WriteAll(m, ptr, nbytes, offset);
+	}
+
+	if (m->write_buf_len == 0) {
+		m->write_buf_start = offset;
+	}
+	memcpy(&m->write_buf[m->write_buf_len], ptr, nbytes);
+	m->write_buf_len += nbytes;
+
+	return nbytes;
+}
+
+static size_t mapped_vfread(void *ptr, size_t size, size_t nitems,
+                            void *handle)
+{
+	struct mapped_vfile *m = handle;
+	size_t nbytes = mapped_vfpread(ptr, size * nitems, m->pos, handle);
+
+	m->pos += nbytes;
+	return nbytes / size;
+}
+
+static size_t mapped_vfwrite(const void *ptr, size_t size,
+                             size_t nitems, void *handle)
+{
+	struct mapped_vfile *m = handle;
+	size_t nbytes = mapped_vfpwrite(ptr, size * nitems, m->pos, handle);
+
+	m->pos += nbytes;
+	return nbytes / size;
+}
+
+static long mapped_vfsize(void *handle)
+{
+	struct mapped_vfile *m = handle;
+	struct stat s;
+
+	FlushWrites(m);
+	if (fstat(m->fd, &s) != 0) {
+		return -1;
+	}
+	return s.st_size;
+}
+
+static int mapped_vfseek(void *handle, long offset, int whence)
+{
+	struct mapped_vfile *m = handle;
+	long size;
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+
+	case SEEK_CUR:
+		offset += m->pos;
+		break;
+
+	case SEEK_END:
+		size = mapped_vfsize(handle);
+		if (size < 0) {
+			return -1;
+		}
+		offset += size;
+		break;
+	}
+
+	if (offset < 0) {
+		return -1;
+	}
+	m->pos = offset;
+	return 0;
+}
+
+static long mapped_vftell(void *handle)
+{
+	struct mapped_vfile *m = handle;
+	return m->pos;
+}
+
+static void mapped_vftruncate(void *handle)
+{
+	struct mapped_vfile *m = handle;
+
+	// Any view of pages past the new EOF would fault the next time it
+	// was read, so all views must be closed first.
+	assert(m->num_views == 0);
+	FlushWrites(m);
+	ftruncate(m->fd, m->pos);
+	Unmap(m);
+}
+
+static void mapped_vfsync(void *handle)
+{
+	struct mapped_vfile *m = handle;
+	FlushWrites(m);
+	fsync(m->fd);
+}
+
+static void mapped_vfclose(void *handle)
+{
+	struct mapped_vfile *m = handle;
+	assert(m->num_views == 0);
+	FlushWrites(m);
+	Unmap(m);
+	close(m->fd);
+	free(m);
+}
+
+static struct vfile_functions mapped_io_functions = {
+	mapped_vfread,
+	mapped_vfwrite,
+	mapped_vfseek,
+	mapped_vftell,
+	mapped_vftruncate,
+	mapped_vfclose,
+	mapped_vfsync,
+	mapped_vfsize,
+	mapped_vfpread,
+	mapped_vfpwrite,
+};
+
+VFILE *vfmapfile(int fd)
+{
+	struct mapped_vfile *m;
+
+	// We pass through failure as a convenience, like vfwrapfile(), so
+	// that `vfmapfile(open("foo", O_RDONLY))` works.
+	if (fd < 0) {
+		return NULL;
+	}
+
+	m = checked_calloc(1, sizeof(struct mapped_vfile));
+	m->fd = fd;
+	m->pos = 0;
+	// The initial mapping is created lazily by the first view; if it
+	// fails we just fall back to normal reads.
+	return vfopen(m, &mapped_io_functions);
+}
+
+static VFILE *MappedView(VFILE *inner, long start, long end)
+{
+	struct mapped_vfile *m = inner->handle;
+	struct memory_vfile *memfile;
+
+	if (inner->functions != &mapped_io_functions || start > end
+	 || !MapRange(m, end)) {
+		return NULL;
+	}
+	// Nothing is mapped for an empty file; the caller falls back to a
+	// normal restricted file instead.
+	if (m->map == NULL) {
+		return NULL;
+	}
+
+	memfile = checked_calloc(1, sizeof(struct memory_vfile));
+	memfile->buf = m->map + start;
+	memfile->buf_len = end - start;
+	memfile->pos = 0;
+	memfile->owner = m;
+	++m->num_views;
+
+	return vfopen(memfile, &memory_io_functions);
+}
+
 int vfcopy(VFILE *from, VFILE *to)
 {
-	uint8_t buf[256];
+	uint8_t buf[COPY_BLOCK_SIZE];
+	const void *src;
 	size_t nbytes;
 
+	// If the source is already in memory (including lumps in a mapped
+	// WAD file) then it can be written out in a single call.
+	if (from->functions == &memory_io_functions) {
+		src = vfborrow(from, &nbytes);
+		return vfwrite(src, 1, nbytes, to) == nbytes ? 0 : -1;
+	}
+
 	for (;;) {
 		nbytes = vfread(buf, 1, sizeof(buf), from);
 		if (nbytes == 0) {
@@ -459,19 +862,53 @@ int vfcopy(VFILE *from, VFILE *to)
 
 void *vfreadall(VFILE *input, size_t *len)
 {
-	VFILE *tmp = vfopenmem(NULL, 0);
-	struct memory_vfile *memfile;
-	void *result;
+	long size = vfsize(input), pos = vftell(input);
+	size_t alloced, nbytes = 0, nread;
+	uint8_t *result;
 
-	vfcopy(input, tmp);
-	memfile	= tmp->handle;
-	result = memfile->buf;
-	if (len != NULL) {
-		*len = memfile->buf_len;
+	// If we know how much is left to read, allocate it all up front.
+	// The extra byte lets us hit EOF without growing the buffer.
+	if (size >= 0 && pos >= 0 && size >= pos) {
+		alloced = size - pos + 1;
+	} else {
+		alloced = COPY_BLOCK_SIZE;
+	}
+	result = checked_malloc(alloced);
+
+	for (;;) {
+		if (nbytes == alloced) {
+			alloced *= 2;
+			result = checked_realloc(result, alloced);
+		}
+		nread = vfread(result + nbytes, 1, alloced - nbytes, input);
+		if (nread == 0) {
+			break;
+		}
+		nbytes += nread;
 	}
-	memfile->buf = NULL;
-	memfile->buf_len = 0;
-	vfclose(tmp);
 
+	if (len != NULL) {
+		*len = nbytes;
+	}
 	return result;
 }
+
+const void *vfborrow(VFILE *input, size_t *len)
+{
+	struct memory_vfile *memfile = input->handle;
+	const void *result;
+
+	// Memory files (including views onto mapped files) can just hand out
+	// a pointer to the rest of their buffer.
+	if (input->functions == &memory_io_functions) {
+		SwitchSavedPos(input, true);
+		result = memfile->buf + memfile->pos;
+		*len = memfile->buf_len - memfile->pos;
+		memfile->pos = memfile->buf_len;
+		return result;
+	}
+
+	free(input->borrowed);
+	input->borrowed = vfreadall(input, len);
+	return input->borrowed;
+}
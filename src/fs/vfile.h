@@ -31,14 +31,29 @@ struct vfile_functions {
 	void (*truncate)(void *handle);
 	void (*close)(void *handle);
 	void (*sync)(void *handle);
+	// Optional; returns total length of the file or -1 if unknown.
+	long (*size)(void *handle);
+	// Optional positional I/O that does not use or change the current
+	// file position. Both return the number of bytes transferred.
+	size_t (*pread)(void *ptr, size_t nbytes, long offset, void *handle);
+	size_t (*pwrite)(const void *ptr, size_t nbytes, long offset,
+	                 void *handle);
 };
 
 VFILE *vfopen(void *handle, struct vfile_functions *funcs);
 VFILE *vfrestrict(VFILE *inner, long start, long end, int ro);
 VFILE *vfwrapfile(FILE *stream);
 
+// File backend using positional I/O on a file descriptor, which is also
+// memory-mapped: read-only slices created with vfrestrict() borrow the
+// mapped pages directly, and other slices use pread/pwrite.
+VFILE *vfmapfile(int fd);
+
 int vfcopy(VFILE *from, VFILE *to);
 
+// Total length of the file, or -1 if not known. Only a hint.
+long vfsize(VFILE *stream);
+
 void vfonclose(VFILE *stream, void (*callback)(VFILE *, void *), void *data);
 
 size_t vfread(void *ptr, size_t size, size_t nitems, VFILE *stream);
@@ -52,6 +67,10 @@ VFILE *vfopenmem(const void *buf, size_t buf_len);
 bool vfgetbuf(VFILE *f, void **buf, size_t *buf_len);
 void *vfreadall(VFILE *input, size_t *len);
 
+// Like vfreadall(), but avoids copying where possible. The returned
+// buffer belongs to the VFILE and is only valid until it is closed.
+const void *vfborrow(VFILE *input, size_t *len);
+
 int vfseek(VFILE *stream, long offset, int whence);
 long vftell(VFILE *stream);
 
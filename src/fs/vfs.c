@@ -67,16 +67,112 @@ char *VFS_EntryPath(struct directory *dir, struct directory_entry *entry)
 	return StringJoin("/", dir->path, entry->name, NULL);
 }
 
-void VFS_FreeEntries(struct directory *d)
+static void InvalidateIndexes(struct directory *dir)
+{
+	dir->serial_index.valid = false;
+	dir->name_index.valid = false;
+}
+
+#define NAME_BLOCK_SIZE 4096
+
+struct name_block {
+	struct name_block *next;
+	size_t len, size;
+	char data[];
+};
+
+static void FreeNameBlocks(struct name_block *b)
+{
+	struct name_block *next;
+
+	while (b != NULL) {
+		next = b->next;
+		free(b);
+		b = next;
+	}
+}
+
+static struct name_block *NewNameBlock(size_t size)
+{
+	struct name_block *b = checked_malloc(sizeof(struct name_block) + size);
+	b->next = NULL;
+	b->len = 0;
+	b->size = size;
+	return b;
+}
+
+// Returns a copy of the first max_len characters of the given name,
+// stored alongside the other names in the directory. Lump names are at
+// most eight characters long, so the names of a WAD directory end up
+// packed back to back and a scan over them walks memory in order.
+char *VFS_AllocEntryName(struct directory *d, const char *name,
+                         size_t max_len)
 {
+	size_t len = strnlen(name, max_len);
+	struct name_block *b = d->name_blocks;
+	char *result;
+
+	if (b == NULL || b->len + len + 1 > b->size) {
+		b = NewNameBlock(len + 1 > NAME_BLOCK_SIZE ?
+		                 len + 1 : NAME_BLOCK_SIZE);
+		b->next = d->name_blocks;
+		d->name_blocks = b;
+	}
+
+	result = b->data + b->len;
+	memcpy(result, name, len);
+	result[len] = '\0';
+	b->len += len + 1;
+	d->names_size += len + 1;
+
+	return result;
+}
+
+static void ReleaseEntryName(struct directory *d, const char *name)
+{
+	d->names_unused += strlen(name) + 1;
+}
+
+// Once most of the name storage belongs to entries that no longer exist,
+// the live names are copied into a single new block. This only happens
+// on a refresh; see VFS_AllocEntryName() in vfs.h.
+static void CompactEntryNames(struct directory *d)
+{
+	struct name_block *b;
+	size_t live, len;
 	int i;
 
+	if (d->names_unused <= d->names_size / 2) {
+		return;
+	}
+
+	live = d->names_size - d->names_unused;
+	b = live > 0 ? NewNameBlock(live) : NULL;
 	for (i = 0; i < d->num_entries; i++) {
-		free(d->entries[i].name);
+		len = strlen(d->entries[i].name) + 1;
+		assert(b->len + len <= b->size);
+		memcpy(b->data + b->len, d->entries[i].name, len);
+		d->entries[i].name = b->data + b->len;
+		b->len += len;
 	}
+
+	FreeNameBlocks(d->name_blocks);
+	d->name_blocks = b;
+	d->names_size = live;
+	d->names_unused = 0;
+	InvalidateIndexes(d);
+}
+
+void VFS_FreeEntries(struct directory *d)
+{
 	free(d->entries);
 	d->entries = NULL;
 	d->num_entries = 0;
+	FreeNameBlocks(d->name_blocks);
+	d->name_blocks = NULL;
+	d->names_size = 0;
+	d->names_unused = 0;
+	InvalidateIndexes(d);
 }
 
 static char *ParentName(const char *path)
@@ -185,32 +281,113 @@ struct directory *VFS_OpenDirByEntry(struct directory *dir,
 	return dir->directory_funcs->open_dir(dir, entry);
 }
 
+static unsigned int HashSerial(uint64_t serial_no)
+{
+	serial_no ^= serial_no >> 33;
+	serial_no *= 0xff51afd7ed558ccdULL;
+	serial_no ^= serial_no >> 33;
+	return (unsigned int) serial_no;
+}
+
+static unsigned int HashName(const char *name)
+{
+	unsigned int result = 2166136261u;
+
+	for (; *name != '\0'; name++) {
+		result = (result ^ (uint8_t) *name) * 16777619u;
+	}
+
+	return result;
+}
+
+static bool SameKey(const struct directory_entry *x,
+                    const struct directory_entry *y, bool by_name)
+{
+	if (by_name) {
+		return !strcmp(x->name, y->name);
+	} else {
+		return x->serial_no == y->serial_no;
+	}
+}
+
+static void BuildIndex(struct directory *dir, struct entry_index *idx,
+                       bool by_name)
+{
+	const struct directory_entry *ent;
+	unsigned int i, h;
+
+	// Keep the table at most half full.
+	if (idx->size < dir->num_entries * 2 || idx->slots == NULL) {
+		idx->size = 16;
+		while (idx->size < dir->num_entries * 2) {
+			idx->size *= 2;
+		}
+		free(idx->slots);
+		idx->slots = checked_calloc(idx->size, sizeof(int));
+	}
+	memset(idx->slots, 0xff, idx->size * sizeof(int));
+
+	// Only the first entry with each key goes in the table, to match
+	// what a linear search would find.
+	for (i = 0; i < dir->num_entries; i++) {
+		ent = &dir->entries[i];
+		h = by_name ? HashName(ent->name) : HashSerial(ent->serial_no);
+		for (;;) {
+			h &= idx->size - 1;
+			if (idx->slots[h] < 0) {
+				idx->slots[h] = i;
+				break;
+			} else if (SameKey(&dir->entries[idx->slots[h]],
+			                   ent, by_name)) {
+				break;
+			}
+			++h;
+		}
+	}
+
+	idx->valid = true;
+}
+
 struct directory_entry *VFS_EntryBySerial(struct directory *dir,
                                           uint64_t serial_no)
 {
+	struct entry_index *idx = &dir->serial_index;
+	unsigned int h;
 	int i;
 
-	for (i = 0; i < dir->num_entries; i++) {
-		if (dir->entries[i].serial_no == serial_no) {
+	if (!idx->valid) {
+		BuildIndex(dir, idx, false);
+	}
+
+	for (h = HashSerial(serial_no);; h++) {
+		i = idx->slots[h & (idx->size - 1)];
+		if (i < 0) {
+			return NULL;
+		} else if (dir->entries[i].serial_no == serial_no) {
 			return &dir->entries[i];
 		}
 	}
-
-	return NULL;
 }
 
 struct directory_entry *VFS_EntryByName(struct directory *dir,
                                         const char *name)
 {
+	struct entry_index *idx = &dir->name_index;
+	unsigned int h;
 	int i;
 
-	for (i = 0; i < dir->num_entries; i++) {
-		if (!strcmp(dir->entries[i].name, name)) {
+	if (!idx->valid) {
+		BuildIndex(dir, idx, true);
+	}
+
+	for (h = HashName(name);; h++) {
+		i = idx->slots[h & (idx->size - 1)];
+		if (i < 0) {
+			return NULL;
+		} else if (!strcmp(dir->entries[i].name, name)) {
 			return &dir->entries[i];
 		}
 	}
-
-	return NULL;
 }
 
 // VFS_SaveRevision takes a new snapshot and creates a new directory_revision
@@ -269,32 +446,103 @@ void VFS_CommitChanges(struct directory *dir, const char *msg, ...)
 	}
 }
 
-// Reload the list of entries for the given directory, returning the index
-// of the first entry to change (or -1 for no change)
-int VFS_Refresh(struct directory *dir)
+// Replace `removed` entries at index `start` with `added` new entries. The
+// names of the new entries must have come from VFS_AllocEntryName().
+void VFS_ReplaceEntries(struct directory *dir, unsigned int start,
+                        unsigned int removed,
+                        const struct directory_entry *entries,
+                        unsigned int added)
+{
+	size_t new_num_entries = dir->num_entries - removed + added;
+	unsigned int i;
+
+	assert(start + removed <= dir->num_entries);
+
+	for (i = start; i < start + removed; i++) {
+		ReleaseEntryName(dir, dir->entries[i].name);
+	}
+
+	if (added > removed) {
+		dir->entries = checked_realloc(dir->entries,
+			new_num_entries * sizeof(struct directory_entry));
+	}
+	memmove(&dir->entries[start + added],
+	        &dir->entries[start + removed],
+	        (dir->num_entries - start - removed)
+	          * sizeof(struct directory_entry));
+	memcpy(&dir->entries[start], entries,
+	       added * sizeof(struct directory_entry));
+	dir->num_entries = new_num_entries;
+
+	InvalidateIndexes(dir);
+}
+
+static bool SameEntry(const struct directory_entry *x,
+                      const struct directory_entry *y)
+{
+	return x->type == y->type && x->size == y->size
+	    && x->serial_no == y->serial_no && !strcmp(x->name, y->name);
+}
+
+// Full refresh, for directories that can only list all their entries.
+// We still only replace the entries that changed, working inwards from
+// both ends of the list.
+void VFS_RefreshAllEntries(struct directory *dir,
+                           struct vfs_refresh_diff *diff)
 {
 	struct directory_entry *entries = NULL;
 	size_t num_entries = 0;
-	int i, result;
+	unsigned int i, prefix = 0, suffix = 0;
 
 	dir->directory_funcs->refresh(dir, &entries, &num_entries);
 
-	// Find the first entry to have changed between the old and new.
-	result = -1;
+	while (prefix < num_entries && prefix < dir->num_entries
+	    && SameEntry(&entries[prefix], &dir->entries[prefix])) {
+		++prefix;
+	}
+	while (suffix < num_entries - prefix
+	    && suffix < dir->num_entries - prefix
+	    && SameEntry(&entries[num_entries - suffix - 1],
+	                 &dir->entries[dir->num_entries - suffix - 1])) {
+		++suffix;
+	}
+
+	diff->removed = dir->num_entries - prefix - suffix;
+	diff->added = num_entries - prefix - suffix;
+	diff->start = diff->removed + diff->added > 0 ? prefix : -1;
+
 	for (i = 0; i < num_entries; i++) {
-		if (i >= dir->num_entries
-		 || strcmp(entries[i].name, dir->entries[i].name) != 0
-		 || entries[i].size != dir->entries[i].size) {
-			result = i;
-			break;
+		if (i < prefix || i >= prefix + diff->added) {
+			ReleaseEntryName(dir, entries[i].name);
 		}
 	}
+	if (diff->start >= 0) {
+		VFS_ReplaceEntries(dir, prefix, diff->removed,
+		                   &entries[prefix], diff->added);
+	}
+	free(entries);
+}
 
-	VFS_FreeEntries(dir);
-	dir->entries = entries;
-	dir->num_entries = num_entries;
+// Reload the list of entries for the given directory.
+void VFS_RefreshDiff(struct directory *dir, struct vfs_refresh_diff *diff)
+{
+	if (dir->directory_funcs->refresh_changes != NULL) {
+		dir->directory_funcs->refresh_changes(dir, diff);
+	} else {
+		VFS_RefreshAllEntries(dir, diff);
+	}
+	CompactEntryNames(dir);
+}
 
-	return result;
+// Reload the list of entries for the given directory, returning the index
+// of the first entry to change (or -1 for no change)
+int VFS_Refresh(struct directory *dir)
+{
+	struct vfs_refresh_diff diff;
+
+	VFS_RefreshDiff(dir, &diff);
+
+	return diff.start;
 }
 
 void VFS_RefreshAll(void)
@@ -320,14 +568,69 @@ bool VFS_Remove(struct directory *dir, struct directory_entry *entry)
 		return false;
 	}
 
+	ReleaseEntryName(dir, dir->entries[index].name);
 	memmove(&dir->entries[index], &dir->entries[index + 1],
 	        (dir->num_entries - index - 1)
 	          * sizeof(struct directory_entry));
 	--dir->num_entries;
+	InvalidateIndexes(dir);
 
 	return true;
 }
 
+bool VFS_RemoveSet(struct directory *dir, struct file_set *set)
+{
+	bool *remove;
+	bool success = true;
+	unsigned int i, j;
+
+	if (dir->readonly) {
+		VFS_StoreError("VFS directory is read only.");
+		return false;
+	}
+
+	VFS_StoreError("");
+
+	remove = checked_calloc(dir->num_entries + 1, sizeof(bool));
+	for (i = 0; i < dir->num_entries; i++) {
+		remove[i] = VFS_SetHas(set, dir->entries[i].serial_no);
+	}
+
+	if (dir->directory_funcs->remove_entries != NULL) {
+		success = dir->directory_funcs->remove_entries(dir, remove);
+		if (!success) {
+			memset(remove, 0, dir->num_entries * sizeof(bool));
+		}
+	} else {
+		// Working backwards means that removing an entry never
+		// changes the index of one still to be removed.
+		for (i = dir->num_entries; success && i > 0; i--) {
+			if (remove[i - 1]) {
+				success = dir->directory_funcs->remove(
+					dir, &dir->entries[i - 1]);
+			}
+			if (!success) {
+				memset(remove, 0, i * sizeof(bool));
+			}
+		}
+	}
+
+	// Filter out whatever was removed.
+	for (i = 0, j = 0; i < dir->num_entries; i++) {
+		if (!remove[i]) {
+			dir->entries[j] = dir->entries[i];
+			++j;
+		} else {
+			ReleaseEntryName(dir, dir->entries[i].name);
+		}
+	}
+	dir->num_entries = j;
+	InvalidateIndexes(dir);
+	free(remove);
+
+	return success;
+}
+
 bool VFS_Rename(struct directory *dir, struct directory_entry *entry,
                 const char *new_name)
 {
@@ -363,6 +666,8 @@ void VFS_DirectoryUnref(struct directory *dir)
 		FreeRevisionChainForward(dir->curr_revision);
 	}
 	VFS_FreeEntries(dir);
+	free(dir->serial_index.slots);
+	free(dir->name_index.slots);
 	free(dir->parent_name);
 	free(dir->path);
 	free(dir);
@@ -395,6 +700,67 @@ bool VFS_SwapEntries(struct directory *dir, unsigned int x, unsigned int y)
 	tmp = dir->entries[x];
 	dir->entries[x] = dir->entries[y];
 	dir->entries[y] = tmp;
+	InvalidateIndexes(dir);
+	return true;
+}
+
+// Reorder using swaps, following each cycle of the permutation.
+static void PermuteBySwapping(struct directory *dir, const unsigned int *order)
+{
+	unsigned int *pos, *at;
+	unsigned int i, j;
+
+	// pos[e] is the current index of the entry originally at index e,
+	// and at[i] is the original index of the entry now at index i.
+	pos = checked_calloc(dir->num_entries + 1, sizeof(unsigned int));
+	at = checked_calloc(dir->num_entries + 1, sizeof(unsigned int));
+	for (i = 0; i < dir->num_entries; i++) {
+		pos[i] = i;
+		at[i] = i;
+	}
+
+	for (i = 0; i < dir->num_entries; i++) {
+		j = pos[order[i]];
+		if (j == i) {
+			continue;
+		}
+		dir->directory_funcs->swap_entries(dir, i, j);
+		at[j] = at[i];
+		pos[at[j]] = j;
+		at[i] = order[i];
+		pos[order[i]] = i;
+	}
+
+	free(pos);
+	free(at);
+}
+
+bool VFS_PermuteEntries(struct directory *dir, const unsigned int *order)
+{
+	struct directory_entry *new_entries;
+	unsigned int i;
+
+	if (dir->readonly || dir->directory_funcs->swap_entries == NULL) {
+		return false;
+	}
+
+	if (dir->directory_funcs->permute_entries != NULL) {
+		dir->directory_funcs->permute_entries(dir, order);
+	} else {
+		PermuteBySwapping(dir, order);
+	}
+
+	new_entries = checked_calloc(dir->num_entries + 1,
+	                             sizeof(struct directory_entry));
+	for (i = 0; i < dir->num_entries; i++) {
+		assert(order[i] < dir->num_entries);
+		new_entries[i] = dir->entries[order[i]];
+	}
+	memcpy(dir->entries, new_entries,
+	       dir->num_entries * sizeof(struct directory_entry));
+	free(new_entries);
+	InvalidateIndexes(dir);
+
 	return true;
 }
 
@@ -35,11 +35,24 @@ enum file_type {
 	FILE_TYPE_PALETTE,
 };
 
-#define EMPTY_FILE_SET {NULL, 0}
+#define EMPTY_FILE_SET {NULL, 0, 0}
 
+// Set of serial numbers, kept as a sorted array. Lookups are a binary
+// search, but adding or removing a single entry shifts the rest of the
+// array along, so changes to large sets should use the bulk operations.
 struct file_set {
 	uint64_t *entries;
 	size_t num_entries;
+	// Allocated size of entries[]; zero if not owned by the set.
+	size_t alloced;
+};
+
+// Describes what VFS_RefreshDiff() changed: the `removed` entries that
+// were at index `start` were replaced by the `added` entries now there.
+// If nothing changed, start is -1.
+struct vfs_refresh_diff {
+	int start;
+	unsigned int removed, added;
 };
 
 struct directory_entry {
@@ -53,15 +66,24 @@ struct directory_funcs {
 	const char *singular, *plural;
 	void (*refresh)(void *dir, struct directory_entry **entries,
 	                size_t *num_entries);
+	// Optional; updates only the entries that have changed, using
+	// VFS_ReplaceEntries(), and describes the change in *diff.
+	void (*refresh_changes)(void *dir, struct vfs_refresh_diff *diff);
 	VFILE *(*open)(void *dir, struct directory_entry *entry);
 	struct directory *(*open_dir)(void *dir,
 	                              struct directory_entry *entry);
 	bool (*remove)(void *dir, struct directory_entry *entry);
+	// Optional; removes every entry i for which remove[i] is true, all
+	// in one go. Falls back to calling remove for each entry.
+	bool (*remove_entries)(void *dir, const bool *remove);
 	bool (*rename)(void *dir, struct directory_entry *entry,
 	               const char *new_name);
 	bool (*need_commit)(void *dir);
 	void (*commit)(void *dir);
 	void (*swap_entries)(void *dir, unsigned int x, unsigned int y);
+	// Optional; reorders all entries in one go so that the entry at
+	// index order[i] moves to index i. Falls back to swap_entries.
+	void (*permute_entries)(void *dir, const unsigned int *order);
 	VFILE *(*save_snapshot)(void *dir);
 	void (*restore_snapshot)(void *dir, VFILE *in);
 	// TODO: insert
@@ -76,6 +98,16 @@ struct directory_revision {
 };
 
 
+struct name_block;
+
+// Hash table mapping keys (serial numbers or names) to the index of the
+// first entry with that key; -1 marks an empty slot.
+struct entry_index {
+	int *slots;
+	unsigned int size;
+	bool valid;
+};
+
 struct directory {
 	enum file_type type;
 	const struct directory_funcs *directory_funcs;
@@ -87,6 +119,13 @@ struct directory {
 	size_t num_entries;
 	struct directory_revision *curr_revision;
 	struct directory *next;
+	// Built on demand, and invalidated whenever entries change.
+	struct entry_index serial_index, name_index;
+	// Entry names are packed into blocks owned by the directory; see
+	// VFS_AllocEntryName(). names_unused counts the bytes belonging to
+	// entries that have since gone away.
+	struct name_block *name_blocks;
+	size_t names_size, names_unused;
 };
 
 struct directory *VFS_OpenDir(const char *path);
@@ -96,10 +135,13 @@ struct directory *VFS_OpenDirByEntry(struct directory *dir,
 VFILE *VFS_Open(const char *path);
 VFILE *VFS_OpenByEntry(struct directory *dir, struct directory_entry *entry);
 bool VFS_Remove(struct directory *dir, struct directory_entry *entry);
+// Remove all entries whose serial numbers are in the given set.
+bool VFS_RemoveSet(struct directory *dir, struct file_set *set);
 bool VFS_Rename(struct directory *dir, struct directory_entry *entry,
                 const char *new_name);
 void VFS_CommitChanges(struct directory *dir, const char *msg, ...);
 int VFS_Refresh(struct directory *dir);
+void VFS_RefreshDiff(struct directory *dir, struct vfs_refresh_diff *diff);
 void VFS_RefreshAll(void);
 struct wad_file *VFS_WadFile(struct directory *dir);
 char *VFS_EntryPath(struct directory *dir, struct directory_entry *entry);
@@ -113,14 +155,34 @@ void VFS_DescribeSet(struct directory *dir, struct file_set *set,
                      char *buf, size_t buf_len);
 void VFS_DescribeSize(const struct directory_entry *ent, char buf[10]);
 bool VFS_SwapEntries(struct directory *dir, unsigned int x, unsigned int y);
+// Reorder the directory so that the entry at index order[i] moves to index
+// i. `order` must be a permutation of all entries in the directory.
+bool VFS_PermuteEntries(struct directory *dir, const unsigned int *order);
 
 void VFS_DirectoryRef(struct directory *dir);
 void VFS_DirectoryUnref(struct directory *dir);
 #define VFS_CloseDir VFS_DirectoryUnref
 
+// Change notification for paths on the real filesystem (see watch.c).
+// VFS_WatchPath() returns a watch handle, or -1 if the path can't be
+// watched. VFS_WatchChanges() returns a count that changes whenever the
+// watched path does (or on every call, if the watch has stopped working).
+// VFS_WatchFd() becomes readable when there are new events for
+// VFS_PollWatches() to read.
+int VFS_WatchPath(const char *path);
+void VFS_Unwatch(int id);
+unsigned int VFS_WatchChanges(int id);
+void VFS_PollWatches(void);
+int VFS_WatchFd(void);
+
 void VFS_ClearSet(struct file_set *l);
 void VFS_AddToSet(struct file_set *l, uint64_t serial_no);
 void VFS_RemoveFromSet(struct file_set *l, uint64_t serial_no);
+// Bulk operations; these take time linear in the size of the set.
+void VFS_AddAllToSet(struct file_set *l, const uint64_t *serial_nos,
+                     size_t count);
+void VFS_RemoveAllFromSet(struct file_set *l, const uint64_t *serial_nos,
+                          size_t count);
 struct directory_entry *VFS_AddGlobToSet(
 	struct directory *dir, struct file_set *l, const char *glob);
 bool VFS_SetHas(struct file_set *l, uint64_t serial_no);
@@ -139,6 +201,17 @@ void VFS_ClearHistory(struct directory *dir);
 void VFS_InitDirectory(struct directory *d, const char *path);
 struct directory_revision *VFS_SaveRevision(struct directory *d);
 void VFS_FreeEntries(struct directory *d);
+// Entry names are only moved when the directory is refreshed, so a
+// directory_entry's name pointer stays valid until the next call to
+// VFS_Refresh() or VFS_RefreshDiff().
+char *VFS_AllocEntryName(struct directory *d, const char *name,
+                         size_t max_len);
+void VFS_ReplaceEntries(struct directory *dir, unsigned int start,
+                        unsigned int removed,
+                        const struct directory_entry *entries,
+                        unsigned int added);
+void VFS_RefreshAllEntries(struct directory *dir,
+                           struct vfs_refresh_diff *diff);
 
 void VFS_StoreError(const char *fmt, ...);
 const char *VFS_LastError(void);
@@ -22,6 +22,8 @@
 struct wad_directory {
 	struct directory dir;
 	struct wad_file *wad_file;
+	// W_DirectoryVersion() when the entries were last refreshed.
+	uint64_t refresh_version;
 };
 
 static void WadDirectoryRefresh(void *_dir, struct directory_entry **entries,
@@ -36,14 +38,73 @@ static void WadDirectoryRefresh(void *_dir, struct directory_entry **entries,
 	for (i = 0; i < num_lumps; i++) {
 		struct directory_entry *ent = *entries + i;
 		ent->type = FILE_TYPE_LUMP;
-		ent->name = checked_calloc(9, 1);
-		memcpy(ent->name, waddir[i].name, 8);
-		ent->name[8] = '\0';
+		ent->name = VFS_AllocEntryName(&dir->dir, waddir[i].name, 8);
 		ent->size = waddir[i].size;
 		ent->serial_no = waddir[i].serial_no;
 	}
 
 	*num_entries = num_lumps;
+	dir->refresh_version = W_DirectoryVersion(dir->wad_file);
+}
+
+static bool SameLump(const struct directory_entry *ent,
+                     const struct wad_file_entry *lump)
+{
+	return ent->size == lump->size && ent->serial_no == lump->serial_no
+	    && !strncmp(ent->name, lump->name, 8);
+}
+
+// Usually only a few lumps change at once, so rather than building a whole
+// new list of entries we only replace the range that is different.
+static void WadDirectoryRefreshChanges(void *_dir,
+                                       struct vfs_refresh_diff *diff)
+{
+	struct wad_directory *dir = _dir;
+	struct wad_file_entry *waddir = W_GetDirectory(dir->wad_file);
+	struct directory_entry *old = dir->dir.entries, *entries;
+	unsigned int i, num_lumps = W_NumLumps(dir->wad_file);
+	unsigned int num_old = dir->dir.num_entries;
+	unsigned int prefix = 0, suffix = 0;
+
+	// Nothing in the WAD directory has changed since we last looked.
+	if (dir->refresh_version == W_DirectoryVersion(dir->wad_file)) {
+		diff->start = -1;
+		return;
+	}
+	dir->refresh_version = W_DirectoryVersion(dir->wad_file);
+
+	while (prefix < num_lumps && prefix < num_old
+	    && SameLump(&old[prefix], &waddir[prefix])) {
+		++prefix;
+	}
+	while (suffix < num_lumps - prefix && suffix < num_old - prefix
+	    && SameLump(&old[num_old - suffix - 1],
+	                &waddir[num_lumps - suffix - 1])) {
+		++suffix;
+	}
+
+	diff->removed = num_old - prefix - suffix;
+	diff->added = num_lumps - prefix - suffix;
+	if (diff->removed + diff->added == 0) {
+		diff->start = -1;
+		return;
+	}
+	diff->start = prefix;
+
+	entries = checked_calloc(diff->added + 1,
+	                         sizeof(struct directory_entry));
+	for (i = 0; i < diff->added; i++) {
+		struct directory_entry *ent = &entries[i];
+		const struct wad_file_entry *lump = &waddir[prefix + i];
+		ent->type = FILE_TYPE_LUMP;
+		ent->name = VFS_AllocEntryName(&dir->dir, lump->name, 8);
+		ent->size = lump->size;
+		ent->serial_no = lump->serial_no;
+	}
+
+	VFS_ReplaceEntries(&dir->dir, prefix, diff->removed,
+	                   entries, diff->added);
+	free(entries);
 }
 
 static VFILE *WadDirOpen(void *_dir, struct directory_entry *entry)
@@ -81,6 +142,13 @@ static bool WadDirRemove(void *_dir, struct directory_entry *entry)
 	return true;
 }
 
+static bool WadDirRemoveEntries(void *_dir, const bool *remove)
+{
+	struct wad_directory *dir = _dir;
+	W_DeleteEntriesByMask(dir->wad_file, remove);
+	return true;
+}
+
 static bool WadDirRename(void *_dir, struct directory_entry *entry,
                          const char *new_name)
 {
@@ -112,6 +180,12 @@ static void WadDirSwapEntries(void *_dir, unsigned int x, unsigned int y)
 	W_SwapEntries(dir->wad_file, x, y);
 }
 
+static void WadDirPermuteEntries(void *_dir, const unsigned int *order)
+{
+	struct wad_directory *dir = _dir;
+	W_PermuteEntries(dir->wad_file, order);
+}
+
 static bool WadDirNeedCommit(void *_dir)
 {
 	struct wad_directory *dir = _dir;
@@ -133,13 +207,16 @@ static void WadDirRestoreSnapshot(void *_dir, VFILE *in)
 static const struct directory_funcs waddir_funcs = {
 	"lump", "lumps",
 	WadDirectoryRefresh,
+	WadDirectoryRefreshChanges,
 	WadDirOpen,
 	WadDirOpenDir,
 	WadDirRemove,
+	WadDirRemoveEntries,
 	WadDirRename,
 	WadDirNeedCommit,
 	WadDirCommit,
 	WadDirSwapEntries,
+	WadDirPermuteEntries,
 	WadDirSaveSnapshot,
 	WadDirRestoreSnapshot,
 	WadDirFree,
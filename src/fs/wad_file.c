@@ -18,20 +18,52 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "common.h"
+#include "stringlib.h"
 #include "ui/dialog.h"
 #include "fs/vfile.h"
 
 #define REVISION_DESCR_LEN  40
 #define WAD_FILE_ENTRY_LEN  16
 
+// Batched lump data is written out once this much has accumulated.
+#define BATCH_BUFFER_SIZE   (1024 * 1024)
+
+// When compacting in place, the least amount of data to move between
+// writing new directories (see CompactInPlace()).
+#define COMPACT_COMMIT_BYTES (1024 * 1024)
+
 struct snapshot {
 	struct wad_file_header header;
 	long eof;
 };
 
+// A range of bytes within the file, [start, end).
+struct wad_extent {
+	uint32_t start, end;
+};
+
+struct wad_batch_lump {
+	unsigned int index;
+	// Position of the lump's data within the batch buffer.
+	size_t offset, size;
+};
+
+struct wad_batch {
+	struct wad_file *f;
+	uint8_t *buf;
+	size_t buf_len, buf_alloced;
+	struct wad_batch_lump *lumps;
+	unsigned int num_lumps, lumps_alloced;
+	bool error;
+};
+
 struct wad_file {
+	char *filename;
 	VFILE *vfs;
 	bool readonly;
 	struct wad_file_entry *directory;
@@ -51,13 +83,149 @@ struct wad_file {
 
 	// Call to W_CommitChanges needed.
 	bool dirty;
+
+	// Hash table used by W_GetNumForName(), mapping lump names to the
+	// index of the last lump with that name (-1 for an empty slot). It
+	// is updated in place for simple changes; otherwise it is marked
+	// invalid and rebuilt on the next lookup.
+	int *name_index;
+	unsigned int name_index_size;
+	bool name_index_valid;
+
+	// Ranges referenced by the directory of any revision we have
+	// committed, which may still be restored by undo or redo. These
+	// are sorted and coalesced, and must never be overwritten.
+	struct wad_extent *retained;
+	unsigned int num_retained;
+
+	// Unused ranges below write_pos that new lump data can be written
+	// into, sorted by position. Built on demand from the current
+	// directory and the retained ranges.
+	struct wad_extent *holes;
+	unsigned int num_holes;
+	bool holes_valid;
+
+	// Batch of lump writes in progress, if any.
+	struct wad_batch *batch;
+
+	// See W_DirectoryVersion().
+	uint64_t directory_version;
 };
 
+static void FlushBatchFor(struct wad_file *f, unsigned int index);
+static const struct wad_batch_lump *PendingBatchLump(struct wad_file *f,
+                                                     unsigned int index);
+
 static void ReadLumpHeader(struct wad_file *wad, struct wad_file_entry *ent)
 {
 	size_t bytes = min(ent->size, LUMP_HEADER_LEN);
 	assert(vfseek(wad->vfs, ent->position, SEEK_SET) == 0);
 	assert(vfread(&ent->lump_header, 1, bytes, wad->vfs) == bytes);
+	ent->lump_header_loaded = true;
+}
+
+static int OrderByPosition(const void *x, const void *y)
+{
+	const struct wad_file_entry *ex = *(const struct wad_file_entry **) x,
+	                            *ey = *(const struct wad_file_entry **) y;
+
+	return (ex->position > ey->position) - (ex->position < ey->position);
+}
+
+// Lump headers are loaded lazily. This loads any that are still pending
+// in the given range, sorted by position so that we read through the
+// file in a single forward sweep rather than jumping around. Lumps with
+// data waiting in a batch are skipped; W_ReadLumpHeader() gets their
+// headers from the batch.
+void W_LoadLumpHeaders(struct wad_file *f, unsigned int start,
+                       unsigned int count)
+{
+	struct wad_file_entry **pending;
+	unsigned int i, num_pending = 0;
+
+	assert(start + count <= f->num_lumps);
+
+	pending = checked_calloc(count + 1, sizeof(struct wad_file_entry *));
+	for (i = start; i < start + count; i++) {
+		if (!f->directory[i].lump_header_loaded
+		 && !f->directory[i].batch_pending) {
+			pending[num_pending] = &f->directory[i];
+			++num_pending;
+		}
+	}
+
+	qsort(pending, num_pending, sizeof(struct wad_file_entry *),
+	      OrderByPosition);
+
+	for (i = 0; i < num_pending; i++) {
+		ReadLumpHeader(f, pending[i]);
+	}
+
+	free(pending);
+}
+
+static unsigned int HashLumpName(const char *name)
+{
+	unsigned int result = 2166136261u;
+	int i;
+
+	for (i = 0; i < 8 && name[i] != '\0'; i++) {
+		result = (result ^ toupper((unsigned char) name[i])) * 16777619u;
+	}
+
+	return result;
+}
+
+// Returns the slot in the name index for the given name: either the slot
+// holding the matching lump, or the empty slot where it would go.
+static int *NameIndexSlot(struct wad_file *f, const char *name)
+{
+	unsigned int mask = f->name_index_size - 1;
+	unsigned int h = HashLumpName(name) & mask;
+	int *slot;
+
+	for (;;) {
+		slot = &f->name_index[h];
+		if (*slot < 0
+		 || !strncasecmp(f->directory[*slot].name, name, 8)) {
+			return slot;
+		}
+		h = (h + 1) & mask;
+	}
+}
+
+// Record that lump `index` has its current name, if it is later in the
+// directory than any other lump with the same name.
+static void NameIndexInsert(struct wad_file *f, unsigned int index)
+{
+	int *slot = NameIndexSlot(f, f->directory[index].name);
+
+	if (*slot < (int) index) {
+		*slot = index;
+	}
+}
+
+static void RebuildNameIndex(struct wad_file *f)
+{
+	unsigned int i, size = 16;
+
+	// Keep the load factor at 50% or less.
+	while (size < f->num_lumps * 2) {
+		size *= 2;
+	}
+	if (size != f->name_index_size) {
+		free(f->name_index);
+		f->name_index = checked_calloc(size, sizeof(int));
+		f->name_index_size = size;
+	}
+	for (i = 0; i < size; i++) {
+		f->name_index[i] = -1;
+	}
+
+	for (i = 0; i < f->num_lumps; i++) {
+		NameIndexInsert(f, i);
+	}
+	f->name_index_valid = true;
 }
 
 static uint64_t NewSerialNo(void)
@@ -68,6 +236,15 @@ static uint64_t NewSerialNo(void)
 	return result;
 }
 
+// Versions are unique across all files, so that callers can use them as
+// cache keys without needing to know which file they came from.
+static void NewDirectoryVersion(struct wad_file *f)
+{
+	static uint64_t version = 0;
+	++version;
+	f->directory_version = version;
+}
+
 static void SwapHeader(struct wad_file_header *hdr)
 {
 	SwapLE32(&hdr->num_lumps);
@@ -102,64 +279,245 @@ bool W_CreateFile(const char *filename)
 	return result;
 }
 
+// Decode on-disk WAD directory table into an array of entries.
+static void DecodeDirectory(struct wad_file_entry *directory,
+                            const uint8_t *table, size_t num_lumps)
+{
+	const uint8_t *p;
+	size_t i;
+
+	for (i = 0, p = table; i < num_lumps; i++, p += WAD_FILE_ENTRY_LEN) {
+		struct wad_file_entry *ent = &directory[i];
+		memcpy(&ent->position, p, 4);
+		memcpy(&ent->size, p + 4, 4);
+		memcpy(ent->name, p + 8, 8);
+		SwapEntry(ent);
+	}
+}
+
+static void EncodeDirectory(uint8_t *table,
+                            const struct wad_file_entry *directory,
+                            size_t num_lumps)
+{
+	struct wad_file_entry ent;
+	uint8_t *p;
+	size_t i;
+
+	for (i = 0, p = table; i < num_lumps; i++, p += WAD_FILE_ENTRY_LEN) {
+		ent = directory[i];
+		SwapEntry(&ent);
+		memcpy(p, &ent.position, 4);
+		memcpy(p + 4, &ent.size, 4);
+		memcpy(p + 8, ent.name, 8);
+	}
+}
+
+static unsigned int HashExtent(const struct wad_file_entry *ent)
+{
+	uint64_t key = ((uint64_t) ent->position << 32) | ent->size;
+
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (unsigned int) key;
+}
+
+// Builds a hash table of the lumps in the current directory whose headers
+// have already been loaded, keyed by (position, size). Slots hold the old
+// lump index or -1 if empty; the table size is returned via *size.
+static int *BuildExtentTable(struct wad_file *wf, unsigned int *size)
+{
+	unsigned int i, h, mask;
+	int *result;
+
+	*size = 16;
+	while (*size < wf->num_lumps * 2) {
+		*size *= 2;
+	}
+	mask = *size - 1;
+	result = checked_malloc(*size * sizeof(int));
+	for (i = 0; i < *size; i++) {
+		result[i] = -1;
+	}
+
+	for (i = 0; i < wf->num_lumps; i++) {
+		if (!wf->directory[i].lump_header_loaded) {
+			continue;
+		}
+		h = HashExtent(&wf->directory[i]) & mask;
+		while (result[h] >= 0) {
+			h = (h + 1) & mask;
+		}
+		result[h] = i;
+	}
+
+	return result;
+}
+
+static struct wad_file_entry *FindExtent(struct wad_file *wf, int *table,
+                                         unsigned int size,
+                                         const struct wad_file_entry *ent)
+{
+	unsigned int mask = size - 1, h = HashExtent(ent) & mask;
+	struct wad_file_entry *oldent;
+
+	while (table[h] >= 0) {
+		oldent = &wf->directory[table[h]];
+		if (ent->position == oldent->position
+		 && ent->size == oldent->size) {
+			return oldent;
+		}
+		h = (h + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static int OrderExtents(const void *x, const void *y)
+{
+	const struct wad_extent *ex = x, *ey = y;
+
+	return (ex->start > ey->start) - (ex->start < ey->start);
+}
+
+// Sort the given extents and merge any that overlap or touch, returning
+// the new count.
+static unsigned int CoalesceExtents(struct wad_extent *extents,
+                                    unsigned int num_extents)
+{
+	unsigned int i, result = 0;
+
+	qsort(extents, num_extents, sizeof(struct wad_extent), OrderExtents);
+
+	for (i = 0; i < num_extents; i++) {
+		if (result > 0 && extents[i].start <= extents[result - 1].end) {
+			extents[result - 1].end =
+				max(extents[result - 1].end, extents[i].end);
+		} else {
+			extents[result] = extents[i];
+			++result;
+		}
+	}
+
+	return result;
+}
+
+// Returns a newly allocated, coalesced array of the extents in use by
+// the current directory (including the header and the on-disk directory
+// table) and by any retained revision.
+static struct wad_extent *UsedExtents(struct wad_file *f,
+                                      unsigned int *num_extents)
+{
+	struct wad_extent *result;
+	unsigned int i, n = 0;
+
+	result = checked_calloc(f->num_lumps + f->num_retained + 2,
+	                        sizeof(struct wad_extent));
+	result[n].start = 0;
+	result[n].end = sizeof(struct wad_file_header);
+	++n;
+	result[n].start = f->header.table_offset;
+	result[n].end = f->header.table_offset
+	              + f->header.num_lumps * WAD_FILE_ENTRY_LEN;
+	++n;
+	for (i = 0; i < f->num_lumps; i++) {
+		if (f->directory[i].size == 0) {
+			continue;
+		}
+		result[n].start = f->directory[i].position;
+		result[n].end = f->directory[i].position
+		              + f->directory[i].size;
+		++n;
+	}
+	for (i = 0; i < f->num_retained; i++) {
+		result[n] = f->retained[i];
+		++n;
+	}
+
+	*num_extents = CoalesceExtents(result, n);
+	return result;
+}
+
+// Called whenever a new revision is committed, so that nothing it
+// refers to gets overwritten while it can still be restored.
+static void RetainDirectory(struct wad_file *f)
+{
+	struct wad_extent *extents;
+	unsigned int num_extents;
+
+	extents = UsedExtents(f, &num_extents);
+	free(f->retained);
+	f->retained = extents;
+	f->num_retained = num_extents;
+}
+
+// Forget about all previous revisions, eg. after the WAD has been
+// compacted and they are no longer valid.
+static void ResetRetained(struct wad_file *f)
+{
+	f->num_retained = 0;
+	RetainDirectory(f);
+	f->holes_valid = false;
+}
+
 // Read WAD directory based on wf->header.table_offet.
 // If there is a current directory, it is replaced.
-#define LOOKAHEAD 30
 static int ReadDirectory(struct wad_file *wf)
 {
-	struct wad_file_entry *new_directory;
+	struct wad_file_entry *new_directory, *oldent;
 	size_t new_num_lumps;
-	int i, j, k, old_lump_index, first_change;
+	unsigned int extents_size;
+	int *extents;
+	uint8_t *table;
+	int i, first_change;
 
 	new_num_lumps = wf->header.num_lumps;
 	first_change = new_num_lumps;
-	assert(vfseek(wf->vfs, wf->header.table_offset, SEEK_SET) == 0);
+
+	// The whole table is read in one go and then decoded.
+	table = checked_malloc(new_num_lumps * WAD_FILE_ENTRY_LEN + 1);
+	if (vfseek(wf->vfs, wf->header.table_offset, SEEK_SET) != 0
+	 || vfread(table, WAD_FILE_ENTRY_LEN, new_num_lumps,
+	           wf->vfs) != new_num_lumps) {
+		free(table);
+		return -1;
+	}
 	new_directory = checked_calloc(
 		new_num_lumps, sizeof(struct wad_file_entry));
+	DecodeDirectory(new_directory, table, new_num_lumps);
+	free(table);
 
-	for (i = 0, j = 0; i < new_num_lumps; i++) {
-		struct wad_file_entry *ent = &new_directory[i], *oldent;
-		if (vfread(&ent->position, 4, 1, wf->vfs) != 1
-		 || vfread(&ent->size, 4, 1, wf->vfs) != 1
-		 || vfread(&ent->name, 8, 1, wf->vfs) != 1) {
-			free(new_directory);
-			return -1;
-		}
-		SwapEntry(ent);
+	// As an optimization, we look up each lump in the old directory by
+	// its position and size. If we find the same lump, we can reuse its
+	// header without reading it again, no matter where it has moved to
+	// in the directory. Otherwise the header will be loaded on demand
+	// by W_ReadLumpHeader().
+	extents = BuildExtentTable(wf, &extents_size);
+
+	for (i = 0; i < new_num_lumps; i++) {
+		struct wad_file_entry *ent = &new_directory[i];
 
 		// We always assign a new serial number, but the
 		// snapshotting code may override it back to an old
 		// version.
 		ent->serial_no = NewSerialNo();
 
-		// As an optimization, look ahead into the old directory
-		// and see if we find the same lump. If we do, we can
-		// skip having to read the lump header again.
-		old_lump_index = -1;
-		oldent = NULL;
-		for (k = j; k < min(j + LOOKAHEAD, wf->num_lumps); k++) {
-			oldent = &wf->directory[k];
-			if (ent->position == oldent->position
-			 && ent->size == oldent->size) {
-				old_lump_index = k;
-				break;
-			}
-		}
-		if (old_lump_index == -1) {
-			long old_pos = vftell(wf->vfs);
-			ReadLumpHeader(wf, ent);
-			vfseek(wf->vfs, old_pos, SEEK_SET);
-		} else {
-			// We got a match!
+		oldent = FindExtent(wf, extents, extents_size, ent);
+		if (oldent != NULL) {
 			memcpy(ent->lump_header, oldent->lump_header,
 			       LUMP_HEADER_LEN);
-			j = old_lump_index + 1;
+			ent->lump_header_loaded = true;
+			ent->data_checks_done = oldent->data_checks_done;
+			ent->data_checks_passed = oldent->data_checks_passed;
 		}
 	}
 
+	free(extents);
 	free(wf->directory);
 	wf->directory = new_directory;
+	wf->name_index_valid = false;
 	wf->num_lumps = new_num_lumps;
+	NewDirectoryVersion(wf);
 	return first_change;
 }
 
@@ -169,9 +527,9 @@ struct wad_file *W_OpenFile(const char *filename)
 	bool readonly = false;
 	VFILE *vfs;
 
-	vfs = vfwrapfile(fopen(filename, "r+"));
+	vfs = vfmapfile(open(filename, O_RDWR));
 	if (vfs == NULL) {
-		vfs = vfwrapfile(fopen(filename, "r"));
+		vfs = vfmapfile(open(filename, O_RDONLY));
 		if (vfs == NULL) {
 			return NULL;
 		}
@@ -179,6 +537,7 @@ struct wad_file *W_OpenFile(const char *filename)
 	}
 
 	result = checked_calloc(1, sizeof(struct wad_file));
+	result->filename = checked_strdup(filename);
 	result->readonly = readonly;
 	result->vfs = vfs;
 	result->directory = NULL;
@@ -202,6 +561,7 @@ struct wad_file *W_OpenFile(const char *filename)
 		W_CloseFile(result);
 		return NULL;
 	}
+	RetainDirectory(result);
 
 	return result;
 }
@@ -223,15 +583,11 @@ struct wad_file_entry *W_GetDirectory(struct wad_file *f)
 
 int W_GetNumForName(struct wad_file *f, const char *name)
 {
-	int i;
-
-	for (i = f->num_lumps - 1; i >= 0; i--) {
-		if (!strncasecmp(f->directory[i].name, name, 8)) {
-			return i;
-		}
+	if (!f->name_index_valid) {
+		RebuildNameIndex(f);
 	}
 
-	return -1;
+	return *NameIndexSlot(f, name);
 }
 
 unsigned int W_NumLumps(struct wad_file *f)
@@ -239,10 +595,16 @@ unsigned int W_NumLumps(struct wad_file *f)
 	return f->num_lumps;
 }
 
+uint64_t W_DirectoryVersion(struct wad_file *f)
+{
+	return f->directory_version;
+}
+
 void W_CloseFile(struct wad_file *f)
 {
 	// All lumps must be closed first.
 	assert(f->lump_open_count == 0);
+	assert(f->batch == NULL);
 
 	// After closing the file we lose all ability to redo (or undo, for
 	// that matter). Any data after the EOF for the current revision
@@ -256,6 +618,10 @@ void W_CloseFile(struct wad_file *f)
 	}
 	vfclose(f->vfs);
 	free(f->directory);
+	free(f->name_index);
+	free(f->retained);
+	free(f->holes);
+	free(f->filename);
 	free(f);
 }
 
@@ -267,6 +633,7 @@ void W_AddEntries(struct wad_file *f, unsigned int before_index,
 
 	assert(!f->readonly);
 	assert(f->current_write_lump == NULL);
+	assert(f->batch == NULL);
 	assert(before_index <= f->num_lumps);
 
 	// We need to rearrange both the WAD directory and the lump headers
@@ -286,7 +653,21 @@ void W_AddEntries(struct wad_file *f, unsigned int before_index,
 		ent->serial_no = NewSerialNo();
 		snprintf(ent->name, 8, "UNNAMED");
 		memset(&ent->lump_header, 0, LUMP_HEADER_LEN);
+		ent->lump_header_loaded = true;
+		ent->batch_pending = false;
+		ent->data_checks_done = 0;
+		ent->data_checks_passed = 0;
+	}
+
+	// Appending new lumps does not move any existing ones, so the name
+	// index can be updated if there is room. Otherwise indexes shift.
+	if (f->name_index_valid && before_index + count == f->num_lumps
+	 && f->num_lumps * 2 <= f->name_index_size) {
+		NameIndexInsert(f, f->num_lumps - 1);
+	} else {
+		f->name_index_valid = false;
 	}
+	NewDirectoryVersion(f);
 	f->dirty = true;
 }
 
@@ -299,12 +680,38 @@ void W_DeleteEntries(struct wad_file *f, unsigned int index, unsigned int cnt)
 {
 	assert(!f->readonly);
 	assert(f->current_write_lump == NULL);
+	assert(f->batch == NULL);
 	assert(index <= f->num_lumps);
 	assert(cnt <= f->num_lumps);
 	assert(index + cnt <= f->num_lumps);
 	memmove(&f->directory[index], &f->directory[index + cnt],
 	        (f->num_lumps - index - cnt) * sizeof(struct wad_file_entry));
 	f->num_lumps -= cnt;
+	f->name_index_valid = false;
+	NewDirectoryVersion(f);
+	f->dirty = true;
+}
+
+void W_DeleteEntriesByMask(struct wad_file *f, const bool *remove)
+{
+	unsigned int i, j;
+
+	assert(!f->readonly);
+	assert(f->current_write_lump == NULL);
+	assert(f->batch == NULL);
+
+	for (i = 0, j = 0; i < f->num_lumps; i++) {
+		if (!remove[i]) {
+			f->directory[j] = f->directory[i];
+			++j;
+		}
+	}
+	if (j == f->num_lumps) {
+		return;
+	}
+	f->num_lumps = j;
+	f->name_index_valid = false;
+	NewDirectoryVersion(f);
 	f->dirty = true;
 }
 
@@ -313,19 +720,42 @@ void W_SetLumpName(struct wad_file *f, unsigned int index, const char *name)
 	unsigned int i;
 	assert(!f->readonly);
 	assert(index < f->num_lumps);
+
+	// If this lump is what the index has for its old name, we would
+	// need to search for an earlier lump with the same name.
+	if (f->name_index_valid
+	 && *NameIndexSlot(f, f->directory[index].name) == index) {
+		f->name_index_valid = false;
+	}
+
 	for (i = 0; i < 8; i++) {
 		f->directory[index].name[i] = toupper(name[i]);
 		if (name[i] == '\0') {
 			break;
 		}
 	}
+	if (f->name_index_valid) {
+		NameIndexInsert(f, index);
+	}
+	NewDirectoryVersion(f);
 	f->dirty = true;
 }
 
 size_t W_ReadLumpHeader(struct wad_file *f, unsigned int index,
                         uint8_t *buf, size_t buf_len)
 {
+	const struct wad_batch_lump *lump;
+
 	assert(index < f->num_lumps);
+	if (f->directory[index].batch_pending) {
+		lump = PendingBatchLump(f, index);
+		buf_len = min(buf_len, min(LUMP_HEADER_LEN, lump->size));
+		memcpy(buf, &f->batch->buf[lump->offset], buf_len);
+		return buf_len;
+	}
+	if (!f->directory[index].lump_header_loaded) {
+		ReadLumpHeader(f, &f->directory[index]);
+	}
 	buf_len = min(buf_len, min(LUMP_HEADER_LEN, f->directory[index].size));
 	memcpy(buf, &f->directory[index].lump_header, buf_len);
 	return buf_len;
@@ -354,6 +784,7 @@ VFILE *W_OpenLump(struct wad_file *f, unsigned int lump_index)
 	long start, end;
 
 	assert(lump_index < f->num_lumps);
+	FlushBatchFor(f, lump_index);
 
 	start = f->directory[lump_index].position;
 	end = start + f->directory[lump_index].size;
@@ -381,13 +812,74 @@ static void WriteLumpClosed(VFILE *fs, void *data)
 	assert(f->current_write_index < f->num_lumps);
 	ent = &f->directory[f->current_write_index];
 	ent->size = (unsigned int) size;
-	f->write_pos = ent->position + ent->size;
+	// Data written into a hole does not move the end of the file.
+	if (ent->position + ent->size > f->write_pos) {
+		f->write_pos = ent->position + ent->size;
+	}
 	f->dirty = true;
+	ent->lump_header_loaded = false;
+	ent->data_checks_done = 0;
+	ent->data_checks_passed = 0;
+	NewDirectoryVersion(f);
+}
 
-	ReadLumpHeader(f, ent);
+static void BuildHoles(struct wad_file *f)
+{
+	struct wad_extent *used;
+	unsigned int i, num_used;
+	uint32_t pos = 0;
+
+	// Lumps written since the last commit are not retained yet, so
+	// the current directory must be included too.
+	used = UsedExtents(f, &num_used);
+
+	free(f->holes);
+	f->holes = checked_calloc(num_used + 1, sizeof(struct wad_extent));
+	f->num_holes = 0;
+
+	for (i = 0; i < num_used && pos < f->write_pos; i++) {
+		if (used[i].start > pos) {
+			f->holes[f->num_holes].start = pos;
+			f->holes[f->num_holes].end =
+				min(used[i].start, f->write_pos);
+			++f->num_holes;
+		}
+		pos = max(pos, used[i].end);
+	}
+
+	free(used);
+	f->holes_valid = true;
 }
 
-VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index)
+// Find the smallest hole that can hold `size` bytes, and claim it.
+static bool AllocateHole(struct wad_file *f, size_t size, uint32_t *pos)
+{
+	struct wad_extent *best = NULL;
+	unsigned int i;
+
+	if (!f->holes_valid) {
+		BuildHoles(f);
+	}
+
+	for (i = 0; i < f->num_holes; i++) {
+		uint32_t hole_size = f->holes[i].end - f->holes[i].start;
+		if (hole_size >= size
+		 && (best == NULL || hole_size < best->end - best->start)) {
+			best = &f->holes[i];
+		}
+	}
+
+	if (best == NULL) {
+		return false;
+	}
+
+	*pos = best->start;
+	best->start += size;
+	return true;
+}
+
+static VFILE *OpenLumpRewriteAt(struct wad_file *f, unsigned int lump_index,
+                                long start, long end)
 {
 	VFILE *result;
 
@@ -395,10 +887,11 @@ VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index)
 	assert(lump_index < f->num_lumps);
 	assert(f->current_write_lump == NULL);
 
-	assert(vfseek(f->vfs, f->write_pos, SEEK_SET) == 0);
-	f->directory[lump_index].position = (unsigned int) f->write_pos;
+	// Any batched write of the same lump must not overwrite this one.
+	FlushBatchFor(f, lump_index);
+	f->directory[lump_index].position = (unsigned int) start;
 
-	result = vfrestrict(f->vfs, f->write_pos, -1, 0);
+	result = vfrestrict(f->vfs, start, end, 0);
 	f->current_write_lump = result;
 	f->current_write_index = lump_index;
 	++f->lump_open_count;
@@ -408,23 +901,289 @@ VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index)
 	return result;
 }
 
-static void WriteDirectory(struct wad_file *f)
+VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index)
 {
-	int i;
+	return OpenLumpRewriteAt(f, lump_index, f->write_pos, -1);
+}
 
-	assert(vfseek(f->vfs, f->write_pos, SEEK_SET) == 0);
+VFILE *W_OpenLumpRewriteSize(struct wad_file *f, unsigned int lump_index,
+                             size_t size)
+{
+	uint32_t pos;
+
+	assert(!f->readonly);
+
+	// Reusing space is only worthwhile if we have data to put in it;
+	// a lump that would fit anywhere can just as well go at the end.
+	if (size == 0 || !AllocateHole(f, size, &pos)) {
+		return W_OpenLumpRewrite(f, lump_index);
+	}
 
+	return OpenLumpRewriteAt(f, lump_index, pos, pos + size);
+}
+
+// Is any part of the given range referenced by a retained revision?
+static bool IsRetained(struct wad_file *f, uint32_t start, uint32_t end)
+{
+	unsigned int lo = 0, hi = f->num_retained, mid;
+
+	// Find the first retained extent that ends after start.
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (f->retained[mid].end <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo < f->num_retained && f->retained[lo].start < end;
+}
+
+// Can the data of the given lump be overwritten in place? Only if nothing
+// else can see the old data: not a revision that can be restored by undo
+// or redo (which includes the last one committed, so that a crash leaves
+// the file intact), and not another lump that shares the same data.
+static bool CanPatchLump(struct wad_file *f, unsigned int lump_index)
+{
+	const struct wad_file_entry *ent = &f->directory[lump_index], *other;
+	uint32_t start = ent->position, end = ent->position + ent->size;
+	unsigned int i;
+
+	if (ent->size == 0 || IsRetained(f, start, end)) {
+		return false;
+	}
 	for (i = 0; i < f->num_lumps; i++) {
-		struct wad_file_entry ent = f->directory[i];
-		SwapEntry(&ent);
-		assert(vfwrite(&ent.position, 4, 1, f->vfs) == 1 &&
-		       vfwrite(&ent.size, 4, 1, f->vfs) == 1 &&
-		       vfwrite(&ent.name, 8, 1, f->vfs) == 1);
+		other = &f->directory[i];
+		if (i != lump_index && other->size > 0
+		 && other->position < end
+		 && other->position + other->size > start) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool W_WriteLumpFrom(struct wad_file *f, unsigned int lump_index, VFILE *in)
+{
+	long size = vfsize(in), pos = vftell(in);
+	struct wad_file_entry *ent;
+	VFILE *out;
+	int err;
+
+	assert(lump_index < f->num_lumps);
+	ent = &f->directory[lump_index];
+
+	// If we know how much data there is, it may fit over the old data
+	// (if no revision needs it), or else into unused space in the WAD,
+	// instead of growing the file.
+	FlushBatchFor(f, lump_index);
+	if (size >= 0 && pos >= 0 && size >= pos && size - pos <= ent->size
+	 && CanPatchLump(f, lump_index)) {
+		out = OpenLumpRewriteAt(f, lump_index, ent->position,
+		                        ent->position + size - pos);
+	} else if (size >= 0 && pos >= 0 && size >= pos) {
+		out = W_OpenLumpRewriteSize(f, lump_index, size - pos);
+	} else {
+		out = W_OpenLumpRewrite(f, lump_index);
 	}
+	if (out == NULL) {
+		return false;
+	}
+
+	err = vfcopy(in, out);
+	vfclose(out);
+
+	return err == 0;
+}
+
+struct wad_batch *W_BeginBatch(struct wad_file *f)
+{
+	struct wad_batch *result;
+
+	assert(!f->readonly);
+	assert(f->batch == NULL);
+
+	result = checked_calloc(1, sizeof(struct wad_batch));
+	result->f = f;
+	f->batch = result;
+	return result;
+}
+
+// Write out all data in the batch as a single write at the end of the
+// file, and point the directory entries at it.
+static void FlushBatch(struct wad_batch *b)
+{
+	struct wad_file *f = b->f;
+	struct wad_file_entry *ent;
+	unsigned int i;
+
+	if (b->num_lumps == 0) {
+		return;
+	}
+
+	if (b->buf_len > 0
+	 && (vfseek(f->vfs, f->write_pos, SEEK_SET) != 0
+	  || vfwrite(b->buf, 1, b->buf_len, f->vfs) != b->buf_len)) {
+		b->error = true;
+	}
+
+	// The lump headers are already in memory, so there is no need to
+	// read them back later.
+	for (i = 0; i < b->num_lumps; i++) {
+		ent = &f->directory[b->lumps[i].index];
+		ent->batch_pending = false;
+		if (b->error) {
+			continue;
+		}
+		ent->position = f->write_pos + b->lumps[i].offset;
+		ent->size = b->lumps[i].size;
+		memset(ent->lump_header, 0, LUMP_HEADER_LEN);
+		memcpy(ent->lump_header, &b->buf[b->lumps[i].offset],
+		       min(ent->size, LUMP_HEADER_LEN));
+		ent->lump_header_loaded = true;
+		ent->data_checks_done = 0;
+		ent->data_checks_passed = 0;
+	}
+
+	if (!b->error) {
+		f->write_pos += b->buf_len;
+		f->dirty = true;
+		NewDirectoryVersion(f);
+	}
+	b->buf_len = 0;
+	b->num_lumps = 0;
+}
+
+// Flush the current batch if it has data pending for the given lump.
+static void FlushBatchFor(struct wad_file *f, unsigned int index)
+{
+	if (f->directory[index].batch_pending) {
+		FlushBatch(f->batch);
+	}
+}
+
+// Returns the batch entry with the data that will end up in the given
+// lump, which must be pending. If the lump was written more than once,
+// the last write wins.
+static const struct wad_batch_lump *PendingBatchLump(struct wad_file *f,
+                                                     unsigned int index)
+{
+	struct wad_batch *b = f->batch;
+	unsigned int i;
+
+	assert(f->directory[index].batch_pending);
+	for (i = b->num_lumps; i > 0; i--) {
+		if (b->lumps[i - 1].index == index) {
+			return &b->lumps[i - 1];
+		}
+	}
+	assert(0);
+	return NULL;
+}
+
+bool W_BatchWriteLump(struct wad_batch *b, unsigned int lump_index,
+                      VFILE *in)
+{
+	struct wad_file *f = b->f;
+	struct wad_batch_lump *lump;
+	struct wad_file_entry *ent;
+	long size = vfsize(in), pos = vftell(in);
+	size_t nread;
+	VFILE *out;
+
+	assert(lump_index < f->num_lumps);
+	assert(f->current_write_lump == NULL);
+
+	if (b->error) {
+		return false;
+	}
+
+	// Big lumps are written straight to the file rather than being
+	// copied into the buffer first.
+	if (size >= 0 && pos >= 0 && size - pos >= BATCH_BUFFER_SIZE) {
+		FlushBatch(b);
+		if (b->error) {
+			return false;
+		}
+		out = W_OpenLumpRewrite(f, lump_index);
+		b->error = vfcopy(in, out) != 0;
+		vfclose(out);
+		return !b->error;
+	}
+
+	if (b->num_lumps == b->lumps_alloced) {
+		b->lumps_alloced = max(b->lumps_alloced * 2, 64);
+		b->lumps = checked_realloc(b->lumps,
+			b->lumps_alloced * sizeof(struct wad_batch_lump));
+	}
+	lump = &b->lumps[b->num_lumps];
+	lump->index = lump_index;
+	lump->offset = b->buf_len;
+
+	for (;;) {
+		if (b->buf_len == b->buf_alloced) {
+			b->buf_alloced = max(b->buf_alloced * 2, 64 * 1024);
+			b->buf = checked_realloc(b->buf, b->buf_alloced);
+		}
+		nread = vfread(&b->buf[b->buf_len], 1,
+		               b->buf_alloced - b->buf_len, in);
+		if (nread == 0) {
+			break;
+		}
+		b->buf_len += nread;
+	}
+
+	lump->size = b->buf_len - lump->offset;
+	++b->num_lumps;
+
+	// Anything known about the old data no longer applies.
+	ent = &f->directory[lump_index];
+	ent->batch_pending = true;
+	ent->data_checks_done = 0;
+	ent->data_checks_passed = 0;
+	NewDirectoryVersion(f);
+
+	if (b->buf_len >= BATCH_BUFFER_SIZE) {
+		FlushBatch(b);
+	}
+
+	return !b->error;
+}
+
+bool W_EndBatch(struct wad_batch *b)
+{
+	struct wad_file *f = b->f;
+	bool result;
+
+	assert(f->batch == b);
+
+	FlushBatch(b);
+	result = !b->error;
+	f->batch = NULL;
+	free(b->buf);
+	free(b->lumps);
+	free(b);
+
+	return result;
+}
+
+static void WriteDirectory(struct wad_file *f)
+{
+	uint8_t *table;
+
+	table = checked_malloc(f->num_lumps * WAD_FILE_ENTRY_LEN + 1);
+	EncodeDirectory(table, f->directory, f->num_lumps);
+	assert(vfseek(f->vfs, f->write_pos, SEEK_SET) == 0);
+	assert(vfwrite(table, WAD_FILE_ENTRY_LEN, f->num_lumps,
+	               f->vfs) == f->num_lumps);
+	free(table);
 
 	// Update header to point to new directory.
 	f->header.table_offset = f->write_pos;
 	f->header.num_lumps = f->num_lumps;
+	RetainDirectory(f);
 
 	// Save the current EOF. If we roll back to the previous directory,
 	// we can truncate the file here.
@@ -446,11 +1205,51 @@ void W_SwapEntries(struct wad_file *f, unsigned int l1, unsigned int l2)
 	}
 
 	assert(f->current_write_lump == NULL);
+	assert(f->batch == NULL);
 	assert(l1 < f->num_lumps);
 	assert(l2 < f->num_lumps);
+
+	// If either lump is the one the name index has for its name, the
+	// index entry would need to move to an earlier lump of that name.
+	// Otherwise the lumps can just be reinserted after the swap.
+	if (f->name_index_valid
+	 && (*NameIndexSlot(f, f->directory[l1].name) == l1
+	  || *NameIndexSlot(f, f->directory[l2].name) == l2)) {
+		f->name_index_valid = false;
+	}
+
 	tmp = f->directory[l1];
 	f->directory[l1] = f->directory[l2];
 	f->directory[l2] = tmp;
+
+	if (f->name_index_valid) {
+		NameIndexInsert(f, l1);
+		NameIndexInsert(f, l2);
+	}
+	NewDirectoryVersion(f);
+	f->dirty = true;
+}
+
+void W_PermuteEntries(struct wad_file *f, const unsigned int *order)
+{
+	struct wad_file_entry *new_directory;
+	unsigned int i;
+
+	assert(!f->readonly);
+	assert(f->current_write_lump == NULL);
+	assert(f->batch == NULL);
+
+	new_directory = checked_calloc(f->num_lumps + 1,
+	                               sizeof(struct wad_file_entry));
+	for (i = 0; i < f->num_lumps; i++) {
+		assert(order[i] < f->num_lumps);
+		new_directory[i] = f->directory[order[i]];
+	}
+	free(f->directory);
+	f->directory = new_directory;
+
+	f->name_index_valid = false;
+	NewDirectoryVersion(f);
 	f->dirty = true;
 }
 
@@ -461,6 +1260,7 @@ bool W_NeedCommit(struct wad_file *f)
 
 void W_CommitChanges(struct wad_file *f)
 {
+	assert(f->batch == NULL);
 	if (f->readonly || !f->dirty) {
 		return;
 	}
@@ -468,16 +1268,120 @@ void W_CommitChanges(struct wad_file *f)
 	WriteDirectory(f);
 }
 
+static uint64_t HashLumpContents(struct wad_file *f, unsigned int index)
+{
+	uint64_t result = 14695981039346656037ULL;
+	const uint8_t *buf;
+	size_t i, len;
+	VFILE *lump;
+
+	lump = W_OpenLump(f, index);
+	buf = vfborrow(lump, &len);
+	for (i = 0; i < len; i++) {
+		result = (result ^ buf[i]) * 1099511628211ULL;
+	}
+	vfclose(lump);
+
+	return result ^ len;
+}
+
+static bool SameLumpData(struct wad_file *f, unsigned int l1,
+                         unsigned int l2, bool compare_contents)
+{
+	const struct wad_file_entry *e1 = &f->directory[l1],
+	                            *e2 = &f->directory[l2];
+	const void *buf1, *buf2;
+	size_t len1, len2;
+	VFILE *lump1, *lump2;
+	bool result;
+
+	if (e1->size != e2->size) {
+		return false;
+	} else if (e1->position == e2->position) {
+		return true;
+	} else if (!compare_contents) {
+		return false;
+	}
+
+	lump1 = W_OpenLump(f, l1);
+	lump2 = W_OpenLump(f, l2);
+	buf1 = vfborrow(lump1, &len1);
+	buf2 = vfborrow(lump2, &len2);
+	result = len1 == len2 && !memcmp(buf1, buf2, len1);
+	vfclose(lump1);
+	vfclose(lump2);
+
+	return result;
+}
+
+// Returns an array that maps each lump to the first lump in the directory
+// that has the same data. Lumps that already share the same data (as in
+// a WAD compressed with wadptr) are always matched; if compare_contents
+// is true then lumps with identical contents are also matched.
+static unsigned int *FindSharedLumps(struct progress_window *progress,
+                                     struct wad_file *f,
+                                     bool compare_contents)
+{
+	unsigned int *result, i, h, mask, size = 16;
+	uint64_t *hashes;
+	int *table;
+
+	while (size < f->num_lumps * 2) {
+		size *= 2;
+	}
+	mask = size - 1;
+	table = checked_malloc(size * sizeof(int));
+	for (i = 0; i < size; i++) {
+		table[i] = -1;
+	}
+	hashes = checked_calloc(f->num_lumps + 1, sizeof(uint64_t));
+	result = checked_calloc(f->num_lumps + 1, sizeof(unsigned int));
+
+	for (i = 0; i < f->num_lumps; i++) {
+		if (compare_contents) {
+			hashes[i] = HashLumpContents(f, i);
+			UI_UpdateProgressWindow(progress, "");
+		} else {
+			hashes[i] = HashExtent(&f->directory[i]);
+		}
+
+		result[i] = i;
+		h = hashes[i] & mask;
+		while (table[h] >= 0) {
+			if (hashes[table[h]] == hashes[i]
+			 && SameLumpData(f, table[h], i, compare_contents)) {
+				result[i] = table[h];
+				break;
+			}
+			h = (h + 1) & mask;
+		}
+		if (result[i] == i) {
+			table[h] = i;
+		}
+	}
+
+	free(table);
+	free(hashes);
+
+	return result;
+}
+
+// Lumps that share the same data only count once.
 static uint32_t MinimumWADSize(struct wad_file *f)
 {
 	size_t result = sizeof(struct wad_file_header)
 	              + WAD_FILE_ENTRY_LEN * f->num_lumps;
+	unsigned int *shared = FindSharedLumps(NULL, f, false);
 	int i;
 
 	for (i = 0; i < f->num_lumps; i++) {
-		result += f->directory[i].size;
+		if (shared[i] == i) {
+			result += f->directory[i].size;
+		}
 	}
 
+	free(shared);
+
 	return result;
 }
 
@@ -495,81 +1399,364 @@ uint32_t W_NumJunkBytes(struct wad_file *f)
 	}
 }
 
-static bool RewriteAllLumps(struct progress_window *progress,
-                            struct wad_file *f)
+// Point every lump that shares its data with an earlier lump at wherever
+// that data currently is.
+static void RepointSharedLumps(struct wad_file *f, const unsigned int *shared)
 {
-	VFILE *lump;
-	uint32_t new_pos;
 	int i;
 
-	if (vfseek(f->vfs, f->write_pos, SEEK_SET) != 0) {
+	for (i = 0; i < f->num_lumps; i++) {
+		if (shared[i] != i) {
+			f->directory[i].position =
+				f->directory[shared[i]].position;
+		}
+	}
+}
+
+static bool CopyLumpTo(struct wad_file *f, struct wad_file_entry *ent,
+                       uint32_t pos)
+{
+	VFILE *lump;
+	int result;
+
+	lump = W_OpenLump(f, ent - f->directory);
+	if (lump == NULL) {
 		return false;
 	}
+	result = vfseek(f->vfs, pos, SEEK_SET) == 0 ? vfcopy(lump, f->vfs) : -1;
+	vfclose(lump);
+	if (result != 0) {
+		return false;
+	}
+	ent->position = pos;
+	f->dirty = true;
+
+	return true;
+}
+
+static void CommitCompaction(struct wad_file *f, const unsigned int *shared)
+{
+	RepointSharedLumps(f, shared);
+	WriteDirectory(f);
+}
 
+// Compact in place by sliding lumps down into the gaps before them, in
+// position order, so that most data is only copied once. The directory on
+// disk must always point at valid data, so a lump can't be written over
+// the old location of any lump whose move has not been committed yet.
+// Moved lumps are collected into a window, and a new directory is
+// committed when the next lump would land on the window's old data, as
+// long as enough has been moved since the last commit to make writing the
+// directory worthwhile. Otherwise, and for any lump that is bigger than
+// the gap in front of it (and so would overwrite itself), the lump is
+// copied out to the end of the file instead, and moved into its place
+// once everything else is done. The cost is therefore the size of the data
+// after the first gap, plus that of the lumps that had to go via the end.
+static bool CompactInPlace(struct progress_window *progress,
+                           struct wad_file *f, const unsigned int *shared)
+{
+	struct wad_file_entry **extents, **staged;
+	uint32_t *staged_pos, dest = sizeof(struct wad_file_header);
+	uint32_t window_start = 0, window_bytes = 0, commit_bytes;
+	unsigned int i, num_extents = 0, num_staged = 0;
+	struct wad_file_entry *ent;
+	bool window_open = false, result = false;
+
+	extents = checked_calloc(f->num_lumps + 1,
+	                         sizeof(struct wad_file_entry *));
+	staged = checked_calloc(f->num_lumps + 1,
+	                        sizeof(struct wad_file_entry *));
+	staged_pos = checked_calloc(f->num_lumps + 1, sizeof(uint32_t));
 	for (i = 0; i < f->num_lumps; i++) {
-		new_pos = vftell(f->vfs);
+		if (shared[i] == i && f->directory[i].size > 0) {
+			extents[num_extents] = &f->directory[i];
+			++num_extents;
+		}
+	}
+	qsort(extents, num_extents, sizeof(struct wad_file_entry *),
+	      OrderByPosition);
+
+	commit_bytes = max(COMPACT_COMMIT_BYTES,
+	                   f->num_lumps * WAD_FILE_ENTRY_LEN);
+
+	// Start by committing a directory with any duplicates already merged
+	// (and any uncommitted changes). Nothing on disk then refers to the
+	// old directory, nor to the duplicate data. All new directories and
+	// lumps copied out of the way go after the current end of the file,
+	// which is past where any lump will end up.
+	CommitCompaction(f, shared);
+
+	for (i = 0; i < num_extents; i++) {
+		UI_UpdateProgressWindow(progress, "");
+		ent = extents[i];
+
+		// Lumps at the start of the file are already in place.
+		if (ent->position == dest) {
+			dest += ent->size;
+			continue;
+		}
+
+		if (window_open && dest + ent->size > window_start
+		 && window_bytes >= commit_bytes) {
+			CommitCompaction(f, shared);
+			window_open = false;
+			window_bytes = 0;
+		}
+		if (!window_open) {
+			window_open = true;
+			window_start = ent->position;
+		}
+		window_bytes += ent->size;
+
+		if (dest + ent->size <= window_start) {
+			if (!CopyLumpTo(f, ent, dest)) {
+				goto fail;
+			}
+		} else {
+			staged[num_staged] = ent;
+			staged_pos[num_staged] = dest;
+			++num_staged;
+			if (!CopyLumpTo(f, ent, f->write_pos)) {
+				goto fail;
+			}
+			f->write_pos += ent->size;
+		}
+		dest += ent->size;
+	}
+
+	// Everything that went via the end of the file can now be put in
+	// its final place, once the rest is committed.
+	if (num_staged > 0) {
+		CommitCompaction(f, shared);
+		window_open = false;
+		for (i = 0; i < num_staged; i++) {
+			if (!CopyLumpTo(f, staged[i], staged_pos[i])) {
+				goto fail;
+			}
+		}
+	}
+
+	// The final directory goes straight after the last lump. If it
+	// would overwrite lumps whose move has not been committed, commit
+	// one more time first.
+	if (window_open
+	 && dest + f->num_lumps * WAD_FILE_ENTRY_LEN > window_start) {
+		CommitCompaction(f, shared);
+	}
+	f->write_pos = dest;
+	CommitCompaction(f, shared);
+	result = true;
+
+fail:
+	free(extents);
+	free(staged);
+	free(staged_pos);
+	return result;
+}
+
+// Make sure that a rename into the given directory has reached the disk.
+static void SyncDirectory(const char *path)
+{
+	char *dir = PathDirName(path);
+	int fd = open(dir, O_RDONLY);
+
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+// Stream the compacted WAD into a new file alongside the original, then
+// atomically replace the original with it. At no point is the original
+// file left in an inconsistent state. If the WAD is a symlink, it is the
+// file that it points to that gets replaced. A file with other hard links
+// can't be replaced without breaking them, so we don't try.
+static bool CompactOutOfPlace(struct progress_window *progress,
+                              struct wad_file *f, const unsigned int *shared)
+{
+	struct wad_file_header hdr;
+	struct wad_file_entry *new_directory = NULL;
+	uint8_t *table = NULL;
+	char *real_filename, *tmp_filename;
+	VFILE *out, *lump;
+	struct stat s;
+	bool success = false;
+	long table_offset, eof;
+	int i, fd;
+
+	real_filename = realpath(f->filename, NULL);
+	if (real_filename == NULL) {
+		return false;
+	}
+	if (stat(real_filename, &s) != 0 || s.st_nlink > 1) {
+		free(real_filename);
+		return false;
+	}
+
+	tmp_filename = StringJoin("", real_filename, ".XXXXXX", NULL);
+	fd = mkstemp(tmp_filename);
+	if (fd < 0) {
+		free(tmp_filename);
+		free(real_filename);
+		return false;
+	}
+	// Keep the same owner and group if we can. Usually only root can
+	// change the owner, but we may still be able to set the group. The
+	// mode is set afterwards, as changing owner clears setuid bits.
+	if (fchown(fd, s.st_uid, s.st_gid) != 0) {
+		fchown(fd, (uid_t) -1, s.st_gid);
+	}
+	fchmod(fd, s.st_mode & 07777);
+	out = vfmapfile(fd);
+
+	new_directory = checked_calloc(f->num_lumps + 1,
+	                               sizeof(struct wad_file_entry));
+	memcpy(new_directory, f->directory,
+	       f->num_lumps * sizeof(struct wad_file_entry));
+
+	// Space for the header, which we write last.
+	memset(&hdr, 0, sizeof(hdr));
+	if (vfwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+		goto fail;
+	}
+
+	for (i = 0; i < f->num_lumps; i++) {
+		UI_UpdateProgressWindow(progress, "");
+		if (shared[i] != i) {
+			new_directory[i].position =
+				new_directory[shared[i]].position;
+			continue;
+		}
+		new_directory[i].position = vftell(out);
 		lump = W_OpenLump(f, i);
 		if (lump == NULL) {
-			return false;
-		}
-		if (vfcopy(lump, f->vfs) != 0) {
-			return false;
+			goto fail;
+		} else if (vfcopy(lump, out) != 0) {
+			vfclose(lump);
+			goto fail;
 		}
 		vfclose(lump);
-		f->directory[i].position = new_pos;
-		UI_UpdateProgressWindow(progress, "");
 	}
 
-	f->write_pos = vftell(f->vfs);
-	WriteDirectory(f);
-	return true;
+	table_offset = vftell(out);
+	table = checked_malloc(f->num_lumps * WAD_FILE_ENTRY_LEN + 1);
+	EncodeDirectory(table, new_directory, f->num_lumps);
+	if (vfwrite(table, WAD_FILE_ENTRY_LEN, f->num_lumps,
+	            out) != f->num_lumps) {
+		goto fail;
+	}
+	eof = vftell(out);
+
+	memcpy(hdr.id, f->header.id, 4);
+	hdr.num_lumps = f->num_lumps;
+	hdr.table_offset = table_offset;
+	SwapHeader(&hdr);
+	if (vfseek(out, 0, SEEK_SET) != 0
+	 || vfwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+		goto fail;
+	}
+	vfsync(out);
+
+	if (rename(tmp_filename, real_filename) != 0) {
+		goto fail;
+	}
+	SyncDirectory(real_filename);
+
+	// The new file has replaced the old one; switch over to it.
+	vfclose(f->vfs);
+	f->vfs = out;
+	free(f->directory);
+	f->directory = new_directory;
+	f->header.num_lumps = f->num_lumps;
+	f->header.table_offset = table_offset;
+	f->write_pos = eof;
+	f->dirty = false;
+	new_directory = NULL;
+	success = true;
+
+fail:
+	if (!success) {
+		vfclose(out);
+		remove(tmp_filename);
+	}
+	free(new_directory);
+	free(table);
+	free(tmp_filename);
+	free(real_filename);
+	return success;
 }
 
-bool W_CompactWAD(struct wad_file *f)
+bool W_CompactWAD(struct wad_file *f, int flags, uint32_t *bytes_saved)
 {
 	struct progress_window progress;
-	uint32_t min_size = MinimumWADSize(f);
+	bool merge = (flags & W_COMPACT_MERGE_DUPLICATES) != 0;
+	long old_eof = f->write_pos;
+	unsigned int *shared;
+	uint32_t min_size;
+	bool result = false, compacted;
+	int i;
 
 	assert(!f->readonly);
 	assert(f->current_write_lump == NULL);
+	assert(f->lump_open_count == 0);
+	assert(f->batch == NULL);
 
-	// Is file length shorter than the minimum size already? (This
-	// can happen if the file was compressed with wadptr)
-	if (vfseek(f->vfs, 0, SEEK_END) != 0 || vftell(f->vfs) <= min_size) {
-		return false;
-	}
-
-	// In compacting the WAD the end goal is to have all lumps at the
-	// start of the file (with no gaps), followed by the WAD directory,
-	// then the EOF. Step 1 is that we move all the existing data to the
-	// end of the file so that it is out of the way. Once this is
-	// complete and the directory has been updated to point to the new
-	// locations, step 2 is that we move all the data back again to the
-	// beginning of the file, then truncate it to the minimum size.
+	*bytes_saved = 0;
 
-	// TODO: Compacting could be made more effective by reusing the code
-	// from wadptr.
+	UI_InitProgressWindow(&progress, f->num_lumps * (merge ? 2 : 1),
+	                      "Compacting WAD");
 
-	UI_InitProgressWindow(&progress, f->num_lumps * 2, "Compacting WAD");
+	// Work out which lumps can share the same data. Lumps that already
+	// do are always kept that way; otherwise compacting a WAD that was
+	// compressed with wadptr would make it bigger.
+	shared = FindSharedLumps(&progress, f, merge);
+	min_size = sizeof(struct wad_file_header)
+	         + WAD_FILE_ENTRY_LEN * f->num_lumps;
+	for (i = 0; i < f->num_lumps; i++) {
+		if (shared[i] == i) {
+			min_size += f->directory[i].size;
+		}
+	}
 
-	// Rewrite the whole file's contents to its end.
-	if (!RewriteAllLumps(&progress, f)) {
-		return false;
+	// Is the current revision at the minimum size already? Then there's
+	// nothing to do. Any data past its EOF (from undone changes) will
+	// be truncated when the file is closed anyway.
+	if (f->write_pos <= min_size) {
+		result = true;
+		goto fail;
 	}
 
-	// Now seek back to the start of file and rewrite everything again.
-	f->write_pos = sizeof(struct wad_file_header);
-	if (!RewriteAllLumps(&progress, f)) {
-		return false;
+	// In compacting the WAD the end goal is to have all lumps at the
+	// start of the file (with no gaps), followed by the WAD directory,
+	// then the EOF. If out-of-place compaction was requested but the
+	// new file can't be used (see W_COMPACT_OUT_OF_PLACE), we fall back
+	// to compacting in place.
+	compacted = (flags & W_COMPACT_OUT_OF_PLACE) != 0
+	         && CompactOutOfPlace(&progress, f, shared);
+	if (!compacted) {
+		progress.total += f->num_lumps;
+		compacted = CompactInPlace(&progress, f, shared);
+	}
+	if (!compacted) {
+		goto fail;
 	}
 
 	// Seek to new EOF, truncate, and we're done.
 	if (vfseek(f->vfs, f->write_pos, SEEK_SET) != 0) {
-		return false;
+		goto fail;
 	}
 	vftruncate(f->vfs);
 
-	return true;
+	if (f->write_pos < old_eof) {
+		*bytes_saved = old_eof - f->write_pos;
+	}
+	ResetRetained(f);
+	result = true;
+
+fail:
+	free(shared);
+	return result;
 }
 
 // We support Undo by just saving a snapshot of the WAD header. Every time
@@ -584,6 +1771,7 @@ VFILE *W_SaveSnapshot(struct wad_file *wf)
 	struct snapshot s;
 	int i;
 
+	assert(wf->batch == NULL);
 	s.header = wf->header;
 	s.eof = wf->write_pos;
 
@@ -605,6 +1793,7 @@ void W_RestoreSnapshot(struct wad_file *wf, VFILE *in)
 	int i;
 
 	assert(!wf->readonly);
+	assert(wf->batch == NULL);
 	assert(vfread(&s, sizeof(struct snapshot), 1, in) == 1);
 	wf->header = s.header;
 	wf->write_pos = s.eof;
@@ -623,4 +1812,5 @@ void W_RestoreSnapshot(struct wad_file *wf, VFILE *in)
 	WriteHeader(wf);
 	wf->write_pos = s.eof;
 	wf->dirty = false;
+	wf->holes_valid = false;
 }
@@ -20,6 +20,7 @@
 #define LUMP_HEADER_LEN 8
 
 struct wad_file;
+struct wad_batch;
 
 struct wad_file_header {
 	char id[4];
@@ -32,7 +33,15 @@ struct wad_file_entry {
 	unsigned int size;
 	char name[8];
 	uint64_t serial_no;
+	// Loaded on demand; use W_ReadLumpHeader() to access it.
 	uint8_t lump_header[LUMP_HEADER_LEN];
+	bool lump_header_loaded;
+	// New data for the lump is waiting to be written out by a batch.
+	bool batch_pending;
+	// Results of checks made on the lump's data when identifying it
+	// (see lump_info.c); one bit per check. Like the header, these
+	// follow the data around and are cleared if the data changes.
+	uint32_t data_checks_done, data_checks_passed;
 };
 
 bool W_CreateFile(const char *filename);
@@ -43,9 +52,43 @@ void W_CloseFile(struct wad_file *f);
 struct wad_file_entry *W_GetDirectory(struct wad_file *f);
 int W_GetNumForName(struct wad_file *f, const char *name);
 unsigned int W_NumLumps(struct wad_file *f);
+// Returns a number that changes whenever lumps are added, removed, renamed,
+// reordered or rewritten. Versions are never reused, even between
+// different files.
+uint64_t W_DirectoryVersion(struct wad_file *f);
 VFILE *W_OpenLump(struct wad_file *f, unsigned int lump_index);
 VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index);
 
+// Like W_OpenLumpRewrite(), but for when the size of the new lump data is
+// known in advance. The data may then be written into unused space inside
+// the file rather than being appended to the end. No more than `size`
+// bytes can be written.
+VFILE *W_OpenLumpRewriteSize(struct wad_file *f, unsigned int lump_index,
+                             size_t size);
+
+// Replace the contents of a lump with the rest of the data from `in`,
+// which is left open. If the amount of data is known and no bigger than
+// the lump is now, it is written over the old data in place, provided
+// that no other lump refers to it and it has not been committed (as undo
+// may need it); otherwise W_OpenLumpRewriteSize() is used. Returns false
+// if the data could not all be written.
+bool W_WriteLumpFrom(struct wad_file *f, unsigned int lump_index, VFILE *in);
+
+// Batched writing of many lumps, eg. for bulk imports. Rather than each
+// lump being written on its own, lump data is collected in memory and
+// written to the end of the file in large sequential chunks, so lumps
+// written one after another end up contiguous in the file. Directory
+// entries are updated when their data is written out, which happens at
+// the latest when W_EndBatch() is called (which returns false if any
+// write failed). Opening or rewriting a lump that is still pending
+// writes out the batch first, but its header can be read without doing
+// so. Entries cannot be added, removed or reordered, nor changes
+// committed, while a batch is in progress.
+struct wad_batch *W_BeginBatch(struct wad_file *f);
+bool W_BatchWriteLump(struct wad_batch *b, unsigned int lump_index,
+                      VFILE *in);
+bool W_EndBatch(struct wad_batch *b);
+
 // Insert new WAD entries before the lump at the given index. If
 // `before_index == W_NumLumps()` then the new lumps are inserted at the
 // end of the directory.
@@ -53,12 +96,20 @@ void W_AddEntries(struct wad_file *f, unsigned int before_index,
                   unsigned int count);
 void W_DeleteEntries(struct wad_file *f, unsigned int index, unsigned int cnt);
 void W_DeleteEntry(struct wad_file *f, unsigned int index);
+// Delete every lump i for which remove[i] is true.
+void W_DeleteEntriesByMask(struct wad_file *f, const bool *remove);
 void W_SetLumpName(struct wad_file *f, unsigned int index, const char *name);
 size_t W_ReadLumpHeader(struct wad_file *f, unsigned int index,
                         uint8_t *buf, size_t buf_len);
+void W_LoadLumpHeaders(struct wad_file *f, unsigned int start,
+                       unsigned int count);
 uint32_t W_NumJunkBytes(struct wad_file *f);
 void W_SwapEntries(struct wad_file *f, unsigned int l1, unsigned int l2);
 
+// Reorder the whole directory at once, so that the lump at index order[i]
+// moves to index i. `order` must be a permutation of all lump indexes.
+void W_PermuteEntries(struct wad_file *f, const unsigned int *order);
+
 // Must be called after any change to the file by above functions
 // (W_AddEntries, W_OpenLumpRewrite, etc.), otherwise the directory will
 // not be updated and the changes will be lost.
@@ -68,7 +119,25 @@ void W_CommitChanges(struct wad_file *f);
 // Functions below this point take effect immediately and do not require
 // calling W_CommitChanges().
 
-bool W_CompactWAD(struct wad_file *f);
+// Flag for W_CompactWAD(): store lumps with identical contents only once,
+// with all their directory entries pointing at the same data.
+#define W_COMPACT_MERGE_DUPLICATES  0x01
+
+// Flag for W_CompactWAD(): write the compacted WAD to a new file and then
+// replace the original with it, so that all data is copied exactly once.
+// Falls back to compacting in place if the new file cannot be created
+// (eg. the directory is not writable), or if the WAD has other hard links
+// that replacing it would break.
+#define W_COMPACT_OUT_OF_PLACE      0x02
+
+// Returns false on error. *bytes_saved is set to the reduction in size
+// of the file, which may be zero if there was nothing to remove. Either
+// way the file is never left in an inconsistent state. Compacting in
+// place slides lumps down into the gaps before them in a single pass, so
+// data before the first gap is not copied at all; lumps that are bigger
+// than the gap in front of them are copied twice, by way of the end of
+// the file.
+bool W_CompactWAD(struct wad_file *f, int flags, uint32_t *bytes_saved);
 
 // Snapshotting functions for implementing undo/redo.
 VFILE *W_SaveSnapshot(struct wad_file *wf);
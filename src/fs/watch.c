@@ -0,0 +1,263 @@
+//
+// Copyright(C) 2024 Simon Howard
+//
+// You can redistribute and/or modify this program under the terms of
+// the GNU General Public License version 2 as published by the Free
+// Software Foundation, or any later version. This program is
+// distributed WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+
+// Change notification for directories on the real filesystem. This is
+// only implemented on Linux, using inotify; elsewhere (and on network
+// filesystems, where inotify can't see remote changes) VFS_WatchPath()
+// always fails and callers must assume that anything may have changed.
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "fs/vfs.h"
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                      | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF \
+                      | IN_MOVED_FROM | IN_MOVED_TO)
+
+// Filesystems where inotify only sees changes made through this machine's
+// own kernel, if it sees anything at all; changes made on the server or
+// by a FUSE daemon go unnoticed, so we don't watch anything on them.
+static const long unwatchable_filesystems[] = {
+	0x6969,      // NFS
+	0x517b,      // SMB
+	0xff534d42,  // CIFS
+	0xfe534d42,  // SMB2
+	0x65735546,  // FUSE (sshfs, etc.)
+	0x01021997,  // 9P
+	0x5346414f,  // AFS
+	0x00c36400,  // Ceph
+	0x73757245,  // Coda
+	0x564c,      // NCP
+};
+
+struct watch {
+	// Handle returned by VFS_WatchPath(). We don't hand out the inotify
+	// watch descriptor itself, as the kernel reuses those.
+	int id;
+	// -1 once the kernel has removed the watch, eg. because the
+	// directory was deleted.
+	int wd;
+	// Watching the same path twice gives the same watch descriptor,
+	// so watches are reference counted.
+	unsigned int refcount;
+	// Incremented for every event seen on the watched path.
+	unsigned int changes;
+};
+
+static int inotify_fd = -1;
+static struct watch *watches;
+static size_t num_watches;
+static int next_watch_id;
+
+static struct watch *FindWatch(int id)
+{
+	size_t i;
+
+	for (i = 0; i < num_watches; i++) {
+		if (watches[i].id == id) {
+			return &watches[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct watch *FindWatchByWd(int wd)
+{
+	size_t i;
+
+	for (i = 0; i < num_watches; i++) {
+		if (watches[i].wd == wd) {
+			return &watches[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool CanWatch(const char *path)
+{
+	struct statfs fs;
+	int i;
+
+	if (statfs(path, &fs) != 0) {
+		return false;
+	}
+
+	for (i = 0; i < arrlen(unwatchable_filesystems); i++) {
+		if ((unsigned long) fs.f_type
+		 == (unsigned long) unwatchable_filesystems[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int VFS_WatchFd(void)
+{
+	if (inotify_fd < 0) {
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	}
+	return inotify_fd;
+}
+
+int VFS_WatchPath(const char *path)
+{
+	struct watch *w;
+	int wd;
+
+	if (VFS_WatchFd() < 0 || !CanWatch(path)) {
+		return -1;
+	}
+
+	wd = inotify_add_watch(inotify_fd, path, WATCH_EVENTS);
+	if (wd < 0) {
+		return -1;
+	}
+
+	w = FindWatchByWd(wd);
+	if (w == NULL) {
+		watches = checked_realloc(watches,
+			(num_watches + 1) * sizeof(struct watch));
+		w = &watches[num_watches];
+		w->id = next_watch_id;
+		w->wd = wd;
+		w->refcount = 0;
+		w->changes = 0;
+		++next_watch_id;
+		++num_watches;
+	}
+	++w->refcount;
+
+	return w->id;
+}
+
+void VFS_Unwatch(int id)
+{
+	struct watch *w = FindWatch(id);
+
+	if (w == NULL) {
+		return;
+	}
+
+	--w->refcount;
+	if (w->refcount > 0) {
+		return;
+	}
+
+	if (w->wd >= 0) {
+		inotify_rm_watch(inotify_fd, w->wd);
+	}
+	*w = watches[num_watches - 1];
+	--num_watches;
+}
+
+// Reads all pending events without blocking, bumping the change count of
+// every watch that they belong to.
+void VFS_PollWatches(void)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	struct watch *w;
+	ssize_t len;
+	size_t i;
+	char *p;
+
+	if (inotify_fd < 0) {
+		return;
+	}
+
+	for (;;) {
+		len = read(inotify_fd, u.buf, sizeof(u.buf));
+		if (len <= 0) {
+			break;
+		}
+		for (p = u.buf; p < u.buf + len;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			// If the kernel's queue overflowed, we don't know
+			// what changed, so assume everything did.
+			if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+				for (i = 0; i < num_watches; i++) {
+					++watches[i].changes;
+				}
+				continue;
+			}
+			w = FindWatchByWd(ev->wd);
+			if (w == NULL) {
+				continue;
+			}
+			++w->changes;
+			// The kernel has dropped the watch and may hand out
+			// the same descriptor again for a different path.
+			if ((ev->mask & IN_IGNORED) != 0) {
+				w->wd = -1;
+			}
+		}
+	}
+}
+
+unsigned int VFS_WatchChanges(int id)
+{
+	struct watch *w;
+
+	VFS_PollWatches();
+	w = FindWatch(id);
+	if (w == NULL) {
+		return 0;
+	}
+
+	// Once the watch is gone we can't tell whether anything changed,
+	// so we have to say that something always did.
+	if (w->wd < 0) {
+		++w->changes;
+	}
+
+	return w->changes;
+}
+
+#else
+
+int VFS_WatchFd(void)
+{
+	return -1;
+}
+
+int VFS_WatchPath(const char *path)
+{
+	return -1;
+}
+
+void VFS_Unwatch(int id)
+{
+}
+
+void VFS_PollWatches(void)
+{
+}
+
+unsigned int VFS_WatchChanges(int id)
+{
+	return 0;
+}
+
+#endif
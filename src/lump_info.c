@@ -10,6 +10,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -33,8 +34,16 @@ struct lump_type {
 	void (*format)(struct wad_file_entry *ent, uint8_t *buf,
 	               char *descr_buf, size_t descr_buf_len);
 	const char *extension;
+	// Optional; used by deep identification to confirm a match from
+	// check() by looking at the start of the lump's data (up to
+	// DEEP_PREFIX_LEN bytes of it).
+	bool (*deep_check)(struct wad_file_entry *ent, const uint8_t *buf,
+	                   size_t buf_len);
 };
 
+// Enough for the column offsets of the widest graphic we identify.
+#define DEEP_PREFIX_LEN (sizeof(struct patch_header) + 320 * 4)
+
 struct lump_description {
 	const char *name, *description;
 };
@@ -102,28 +111,83 @@ static const struct sized_lump lumps_by_size[] = {
 	{0,      "Empty"},
 };
 
-bool LI_LumpInSection(struct wad_file *wf, unsigned int lump_index,
-                      const struct lump_section *section)
+// Every section type, so that one pass over the directory can find them
+// all at once.
+static const struct lump_section *all_sections[] = {
+	&lump_section_sprites,
+	&lump_section_patches,
+	&lump_section_flats,
+	&lump_section_colormaps,
+};
+
+// A lump is in a section if there is a start marker somewhere before it,
+// and an end marker somewhere after it. All we need to know is where the
+// first start marker and the last end marker are. This index is for the
+// directory last looked at, and is rebuilt whenever that changes.
+static struct {
+	uint64_t version;
+	int first_start[arrlen(all_sections)];
+	int last_end[arrlen(all_sections)];
+} section_index;
+
+static bool IsMarker(const char *name, const char *m1, const char *m2)
+{
+	return !strncasecmp(name, m1, 8) || !strncasecmp(name, m2, 8);
+}
+
+static void BuildSectionIndex(struct wad_file *wf)
 {
 	const struct wad_file_entry *dir = W_GetDirectory(wf);
+	const struct lump_section *section;
 	int num_lumps = W_NumLumps(wf);
-	int i;
+	int i, j;
 
-	for (i = lump_index; i >= 0 && i < num_lumps; i--) {
-		if (!strncasecmp(dir[i].name, section->start1, 8)
-		 || !strncasecmp(dir[i].name, section->start2, 8)) {
-			break;
+	for (j = 0; j < arrlen(all_sections); j++) {
+		section_index.first_start[j] = -1;
+		section_index.last_end[j] = -1;
+	}
+
+	for (i = 0; i < num_lumps; i++) {
+		// All marker names have an underscore as their second or
+		// third character; most lumps can be skipped quickly.
+		if (dir[i].name[1] != '_' && dir[i].name[2] != '_') {
+			continue;
+		}
+		for (j = 0; j < arrlen(all_sections); j++) {
+			section = all_sections[j];
+			if (section_index.first_start[j] < 0
+			 && IsMarker(dir[i].name, section->start1,
+			             section->start2)) {
+				section_index.first_start[j] = i;
+			}
+			if (IsMarker(dir[i].name, section->end1,
+			             section->end2)) {
+				section_index.last_end[j] = i;
+			}
 		}
 	}
-	if (i < 0) {
-		return false;
+
+	section_index.version = W_DirectoryVersion(wf);
+}
+
+bool LI_LumpInSection(struct wad_file *wf, unsigned int lump_index,
+                      const struct lump_section *section)
+{
+	int i;
+
+	if (section_index.version != W_DirectoryVersion(wf)) {
+		BuildSectionIndex(wf);
 	}
-	for (i = lump_index + 1; i < num_lumps; i++) {
-		if (!strncasecmp(dir[i].name, section->end1, 8)
-		 || !strncasecmp(dir[i].name, section->end2, 8)) {
-			return true;
+
+	for (i = 0; i < arrlen(all_sections); i++) {
+		if (all_sections[i] == section) {
+			return section_index.first_start[i] >= 0
+			    && section_index.first_start[i] <= (int) lump_index
+			    && section_index.last_end[i] > (int) lump_index;
 		}
 	}
+
+	assert(false);
 	return false;
 }
 
@@ -233,10 +297,18 @@ static void GraphicLumpFormat(struct wad_file_entry *ent, uint8_t *buf,
 	         patch.leftoffset, patch.topoffset);
 }
 
+// Uses the same column offset checks as the graphic converter.
+static bool GraphicLumpDeepCheck(struct wad_file_entry *ent,
+                                 const uint8_t *buf, size_t buf_len)
+{
+	return V_CheckPatchColumns(buf, buf_len, ent->size);
+}
+
 const struct lump_type lump_type_graphic = {
 	GraphicLumpCheck,
 	GraphicLumpFormat,
 	".png",
+	GraphicLumpDeepCheck,
 };
 
 // Floor/ceiling texture.
@@ -538,10 +610,17 @@ static void PlainTextLumpFormat(struct wad_file_entry *ent, uint8_t *buf,
 	snprintf(descr_buf, descr_buf_len, "%s", "Plain text");
 }
 
+static bool PlainTextLumpDeepCheck(struct wad_file_entry *ent,
+                                   const uint8_t *buf, size_t buf_len)
+{
+	return IsPlainText(buf, buf_len);
+}
+
 const struct lump_type lump_type_plaintext = {
 	PlainTextLumpCheck,
 	PlainTextLumpFormat,
 	".txt",
+	PlainTextLumpDeepCheck,
 };
 
 // TEXTURE1 etc.
@@ -647,6 +726,8 @@ const struct lump_type lump_type_unknown = {
 	UnknownLumpFormat,
 };
 
+// No more than 32 of these, as each type's deep_check() gets a bit in
+// the directory entry's data_checks_done.
 static const struct lump_type *lump_types[] = {
 	&lump_type_dehacked,
 	&lump_type_level,
@@ -669,55 +750,239 @@ static const struct lump_type *lump_types[] = {
 	&lump_type_unknown,
 };
 
-const struct lump_type *LI_IdentifyLump(struct wad_file *f,
-                                        unsigned int lump_index)
-{
-	struct wad_file_entry *ent;
-	uint8_t buf[8];
+// Cache of lump classifications, indexed by serial number. Identifying a
+// lump only depends on its name, size, header and the sections it is in,
+// so a cached result stays valid for as long as those are unchanged; a
+// rewritten lump or a change in its section context is a cache miss.
+// Deep identification also depends on the results of the deep_check()
+// functions, but those are kept in the WAD directory entry itself (see
+// data_checks_done), so they are never evicted and survive renames and
+// reordering; only a change to the lump's data forgets them.
+#define CLASSIFICATION_CACHE_SIZE 4096
+
+struct classification {
+	uint64_t serial_no;
+	// W_DirectoryVersion() when the inputs were last checked.
+	uint64_t version;
+	char name[8];
+	unsigned int size;
+	uint8_t header[LUMP_HEADER_LEN];
+	bool in_flats, in_colormaps;
+	const struct lump_type *type;
+	// Built on demand by LI_DescribeLump().
+	const struct lump_type *description_type;
+	char *description;
+};
+
+static struct classification classifications[CLASSIFICATION_CACHE_SIZE];
+
+// Gathers everything that identification depends on into *c.
+static void ClassificationInputs(struct wad_file *f, unsigned int lump_index,
+                                 struct classification *c)
+{
+	struct wad_file_entry *ent = &W_GetDirectory(f)[lump_index];
+
+	c->serial_no = ent->serial_no;
+	memcpy(c->name, ent->name, 8);
+	c->size = ent->size;
+	memset(c->header, 0, LUMP_HEADER_LEN);
+	W_ReadLumpHeader(f, lump_index, c->header, LUMP_HEADER_LEN);
+	c->in_flats = LI_LumpInSection(f, lump_index, &lump_section_flats);
+	c->in_colormaps =
+		LI_LumpInSection(f, lump_index, &lump_section_colormaps);
+}
+
+// For deep identification, any deep_check() functions must agree too.
+// Their results are taken from the directory entry if they have been run
+// before; otherwise `data` is the start of the lump's data, or NULL if we
+// don't have it yet, in which case NULL is returned.
+static const struct lump_type *IdentifyFromInputs(
+	struct wad_file_entry *ent, struct classification *inputs,
+	bool deep, const uint8_t *data, size_t data_len)
+{
+	const struct lump_type *t;
+	uint32_t check_bit;
 	int i;
 
-	ent = &W_GetDirectory(f)[lump_index];
-
 	// Flats are a special case where we look at lump size but also
 	// check the section of the WAD; it must be between
 	// F_START/F_END markers.
-	if (ent->size >= 4096 && (ent->size % 64) == 0
-	 && LI_LumpInSection(f, lump_index, &lump_section_flats)) {
+	if (ent->size >= 4096 && (ent->size % 64) == 0 && inputs->in_flats) {
 		return &lump_type_flat;
 	}
 
 	if (ent->size > 0 && (ent->size % 256) == 0
-	 && LI_LumpInSection(f, lump_index, &lump_section_colormaps)) {
+	 && inputs->in_colormaps) {
 		return &lump_type_colormap;
 	}
 
-	memset(buf, 0, sizeof(buf));
-	W_ReadLumpHeader(f, lump_index, buf, sizeof(buf));
-
 	for (i = 0; i < arrlen(lump_types); i++) {
-		if (lump_types[i]->check(ent, buf)) {
-			return lump_types[i];
+		t = lump_types[i];
+		if (!t->check(ent, inputs->header)) {
+			continue;
+		}
+		if (!deep || t->deep_check == NULL) {
+			return t;
+		}
+		assert(i < 32);
+		check_bit = 1U << i;
+		if ((ent->data_checks_done & check_bit) == 0) {
+			if (data == NULL) {
+				return NULL;
+			}
+			if (t->deep_check(ent, data, data_len)) {
+				ent->data_checks_passed |= check_bit;
+			}
+			ent->data_checks_done |= check_bit;
+		}
+		if ((ent->data_checks_passed & check_bit) != 0) {
+			return t;
 		}
 	}
 
-	return NULL;
+	// Not reached; lump_type_unknown matches anything.
+	return &lump_type_unknown;
 }
 
-const char *LI_DescribeLump(const struct lump_type *t, struct wad_file *f,
-                            unsigned int lump_index)
+// Returns the cache entry for the given lump, classifying it first if
+// it is not already in the cache.
+static struct classification *Classify(struct wad_file *f,
+                                       unsigned int lump_index)
 {
-	static char description_buf[128];
-	struct wad_file_entry *ent;
-	uint8_t buf[8];
+	uint64_t serial_no = W_GetDirectory(f)[lump_index].serial_no;
+	uint64_t version = W_DirectoryVersion(f);
+	struct classification inputs, *c;
 
-	ent = &W_GetDirectory(f)[lump_index];
+	c = &classifications[serial_no % CLASSIFICATION_CACHE_SIZE];
+
+	// If nothing in the WAD has changed since we last checked, none of
+	// the inputs can have changed either.
+	if (c->type != NULL && c->serial_no == serial_no
+	 && c->version == version) {
+		return c;
+	}
 
-	memset(buf, 0, sizeof(buf));
-	W_ReadLumpHeader(f, lump_index, buf, sizeof(buf));
+	ClassificationInputs(f, lump_index, &inputs);
 
-	t->format(ent, buf, description_buf, sizeof(description_buf));
+	if (c->type != NULL && c->serial_no == inputs.serial_no
+	 && !memcmp(c->name, inputs.name, 8)
+	 && c->size == inputs.size
+	 && !memcmp(c->header, inputs.header, LUMP_HEADER_LEN)
+	 && c->in_flats == inputs.in_flats
+	 && c->in_colormaps == inputs.in_colormaps) {
+		c->version = version;
+		return c;
+	}
+
+	free(c->description);
+	*c = inputs;
+	c->version = version;
+	c->type = IdentifyFromInputs(&W_GetDirectory(f)[lump_index],
+	                             &inputs, false, NULL, 0);
+	c->description_type = NULL;
+	c->description = NULL;
+
+	return c;
+}
+
+// The result of deep identification is used if we have one.
+const struct lump_type *LI_IdentifyLump(struct wad_file *f,
+                                        unsigned int lump_index)
+{
+	struct classification *c = Classify(f, lump_index);
+	const struct lump_type *result;
+
+	if (c->type->deep_check == NULL) {
+		return c->type;
+	}
+
+	result = IdentifyFromInputs(&W_GetDirectory(f)[lump_index], c,
+	                            true, NULL, 0);
+
+	return result != NULL ? result : c->type;
+}
+
+const struct lump_type *LI_IdentifyLumpDeep(struct wad_file *f,
+                                            unsigned int lump_index)
+{
+	struct wad_file_entry *ent = &W_GetDirectory(f)[lump_index];
+	struct classification *c = Classify(f, lump_index);
+	const struct lump_type *result;
+	uint8_t buf[DEEP_PREFIX_LEN];
+	size_t buf_len = 0;
+	VFILE *lump;
+
+	// Only lump types with a deep check need the lump data.
+	if (c->type->deep_check == NULL) {
+		return c->type;
+	}
+
+	result = IdentifyFromInputs(ent, c, true, NULL, 0);
+	if (result != NULL) {
+		return result;
+	}
+
+	lump = W_OpenLump(f, lump_index);
+	if (lump != NULL) {
+		buf_len = vfread(buf, 1, sizeof(buf), lump);
+		vfclose(lump);
+	}
+
+	return IdentifyFromInputs(ent, c, true, buf, buf_len);
+}
+
+struct lump_position {
+	unsigned int index, position;
+};
+
+static int OrderByPosition(const void *x, const void *y)
+{
+	const struct lump_position *px = x, *py = y;
+
+	if (px->position != py->position) {
+		return px->position < py->position ? -1 : 1;
+	}
+	return 0;
+}
+
+void LI_IdentifyLumpsDeep(struct wad_file *f, const unsigned int *indexes,
+                          size_t count)
+{
+	const struct wad_file_entry *dir = W_GetDirectory(f);
+	struct lump_position *lumps;
+	size_t i;
+
+	// Visiting the lumps in the order their data appears in the file
+	// means that we read through it in one sequential sweep.
+	lumps = checked_calloc(count + 1, sizeof(struct lump_position));
+	for (i = 0; i < count; i++) {
+		lumps[i].index = indexes[i];
+		lumps[i].position = dir[indexes[i]].position;
+	}
+	qsort(lumps, count, sizeof(struct lump_position), OrderByPosition);
+
+	for (i = 0; i < count; i++) {
+		LI_IdentifyLumpDeep(f, lumps[i].index);
+	}
+
+	free(lumps);
+}
+
+const char *LI_DescribeLump(const struct lump_type *t, struct wad_file *f,
+                            unsigned int lump_index)
+{
+	struct classification *c = Classify(f, lump_index);
+	struct wad_file_entry *ent = &W_GetDirectory(f)[lump_index];
+	char buf[128];
+
+	if (c->description_type != t) {
+		t->format(ent, c->header, buf, sizeof(buf));
+		free(c->description);
+		c->description = checked_strdup(buf);
+		c->description_type = t;
+	}
 
-	return description_buf;
+	return c->description;
 }
 
 const char *LI_GetExtension(const struct lump_type *lt, bool convert)
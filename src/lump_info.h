@@ -42,6 +42,17 @@ extern const struct lump_section lump_section_flats;
 
 const struct lump_type *LI_IdentifyLump(struct wad_file *f,
                                         unsigned int lump_index);
+// Deep identification also looks at the start of the lump's data, which
+// catches lumps that only look like graphics or text from their header.
+const struct lump_type *LI_IdentifyLumpDeep(struct wad_file *f,
+                                            unsigned int lump_index);
+// Deep identification of many lumps at once, in one pass through the file.
+// The results are cached for LI_IdentifyLump() and LI_IdentifyLumpDeep().
+void LI_IdentifyLumpsDeep(struct wad_file *f, const unsigned int *indexes,
+                          size_t count);
+// The returned string belongs to the classification cache, and is only
+// valid until the next call to LI_DescribeLump() or LI_IdentifyLump*(),
+// any of which may reuse its slot in the cache for another lump.
 const char *LI_DescribeLump(const struct lump_type *t, struct wad_file *f,
                             unsigned int lump_index);
 const char *LI_GetExtension(const struct lump_type *lt, bool convert);
@@ -112,7 +112,8 @@ static bool CopyPaletteToWAD(struct directory *from,
                              struct file_set *result)
 {
 	struct palette_set *set = LoadPalette(from, ent);
-	VFILE *converted, *out;
+	VFILE *converted;
+	bool success;
 	int idx;
 
 	if (set == NULL) {
@@ -131,13 +132,16 @@ static bool CopyPaletteToWAD(struct directory *from,
 	idx = W_NumLumps(wf);
 	W_AddEntries(wf, idx, 1);
 	W_SetLumpName(wf, idx, "PLAYPAL");
-	out = W_OpenLumpRewrite(wf, idx);
-	vfcopy(converted, out);
+	success = W_WriteLumpFrom(wf, idx, converted);
 	vfclose(converted);
-	vfclose(out);
+	PAL_FreePaletteSet(set);
+
+	if (!success) {
+		ConversionError("Error writing PLAYPAL lump to WAD");
+		return false;
+	}
 
 	VFS_AddToSet(result, W_GetDirectory(wf)[idx].serial_no);
-	PAL_FreePaletteSet(set);
 
 	return true;
 }
@@ -270,9 +274,10 @@ static void PerformSetPalettePref(void)
 {
 	struct file_set *set = B_DirectoryPaneTagged(active_pane);
 	struct wad_file *wf = VFS_WadFile(other_pane->dir);
-	VFILE *in, *out, *marshaled;
+	VFILE *in, *marshaled;
 	struct palette_set *pal;
 	struct directory_entry *ent;
+	bool success;
 	int idx = 0;
 
 	if (set->num_entries != 1) {
@@ -314,10 +319,13 @@ static void PerformSetPalettePref(void)
 		W_AddEntries(wf, idx, 1);
 		W_SetLumpName(wf, idx, "PALPREF");
 	}
-	out = W_OpenLumpRewrite(wf, idx);
-	vfcopy(marshaled, out);
+	success = W_WriteLumpFrom(wf, idx, marshaled);
 	vfclose(marshaled);
-	vfclose(out);
+	if (!success) {
+		VFS_Rollback(other_pane->dir);
+		UI_MessageBox("Error writing PALPREF lump to WAD.");
+		return;
+	}
 
 	VFS_CommitChanges(other_pane->dir, "setting preferred palette");
 	VFS_Refresh(other_pane->dir);
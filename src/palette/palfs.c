@@ -78,6 +78,7 @@ static void PaletteFSRefresh(void *dir, struct directory_entry **entries,
 	for (i = 0; i < pd->inner->num_entries; i++) {
 		struct directory_entry *inner_ent = &pd->inner->entries[i];
 		struct directory_entry *ent = &(*entries)[*num_entries];
+		char *name;
 
 		if (inner_ent->type != FILE_TYPE_FILE
 		 || !StringHasSuffix(inner_ent->name, ".png")) {
@@ -85,14 +86,15 @@ static void PaletteFSRefresh(void *dir, struct directory_entry **entries,
 		}
 
 		ent->type = FILE_TYPE_PALETTE;
-		ent->name = checked_strdup(inner_ent->name);
-		*strstr(ent->name, ".png") = '\0';
+		name = checked_strdup(inner_ent->name);
+		*strstr(name, ".png") = '\0';
 		if (!strcmp(inner_ent->name, def_pal)) {
-			char *old_name = ent->name;
-			ent->name = StringJoin("", old_name,
-			                       " [default]", NULL);
+			char *old_name = name;
+			name = StringJoin("", old_name, " [default]", NULL);
 			free(old_name);
 		}
+		ent->name = VFS_AllocEntryName(&pd->dir, name, SIZE_MAX);
+		free(name);
 		ent->size = -1;
 		ent->serial_no = inner_ent->serial_no;
 
@@ -164,13 +166,16 @@ static void PaletteFSFree(void *dir)
 static const struct directory_funcs palette_fs_functions = {
 	"palette", "palettes",
 	PaletteFSRefresh,
+	NULL, // refresh_changes
 	PaletteFSOpen,
 	PaletteFSOpenDir,
 	PaletteFSRemove,
+	NULL, // remove_entries
 	PaletteFSRename,
 	NULL, // need_commit
 	NULL, // commit
 	NULL, // swap_entries
+	NULL, // permute_entries
 	NULL, // save_snapshot
 	NULL, // restore_snapshot
 	PaletteFSFree,
@@ -80,7 +80,8 @@ bool TX_BundleSavePnamesTo(struct texture_bundle *b, struct directory *dir)
 {
 	int lumpnum;
 	struct wad_file *wf = VFS_WadFile(dir);
-	VFILE *lump, *marshaled;
+	VFILE *marshaled;
+	bool success;
 
 	// No need to save?
 	if (b->pn->modified_count == 0) {
@@ -93,11 +94,13 @@ bool TX_BundleSavePnamesTo(struct texture_bundle *b, struct directory *dir)
 		return false;
 	}
 
-	lump = W_OpenLumpRewrite(wf, lumpnum);
 	marshaled = TX_MarshalPnames(b->pn);
-	vfcopy(marshaled, lump);
-	vfclose(lump);
+	success = W_WriteLumpFrom(wf, lumpnum, marshaled);
 	vfclose(marshaled);
+	if (!success) {
+		ConversionError("Error writing PNAMES lump.");
+		return false;
+	}
 	return true;
 }
 
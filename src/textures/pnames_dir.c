@@ -9,6 +9,7 @@
 //
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -41,9 +42,8 @@ static void PnamesDirRefresh(void *_dir, struct directory_entry **entries,
 	new_entries = checked_calloc(*num_entries,
 	                             sizeof(struct directory_entry));
 	for (i = 0; i < *num_entries; i++) {
-		new_entries[i].name = checked_calloc(9, 1);
-		memcpy(new_entries[i].name, PNAMES(dir)->pnames[i], 8);
-		new_entries[i].name[8] = '\0';
+		new_entries[i].name = VFS_AllocEntryName(
+			&dir->dir.dir, PNAMES(dir)->pnames[i], 8);
 
 		new_entries[i].type = FILE_TYPE_PNAME;
 		new_entries[i].size = 0;
@@ -106,6 +106,23 @@ static void PnamesDirSwapEntries(void *_dir, unsigned int x, unsigned int y)
 	++PNAMES(dir)->modified_count;
 }
 
+static void PnamesDirPermuteEntries(void *_dir, const unsigned int *order)
+{
+	struct pnames_dir *dir = _dir;
+	pname *new_pnames;
+	unsigned int i;
+
+	new_pnames = checked_calloc(PNAMES(dir)->num_pnames + 1, sizeof(pname));
+	for (i = 0; i < PNAMES(dir)->num_pnames; i++) {
+		assert(order[i] < PNAMES(dir)->num_pnames);
+		memcpy(new_pnames[i], PNAMES(dir)->pnames[order[i]], 8);
+	}
+	free(PNAMES(dir)->pnames);
+	PNAMES(dir)->pnames = new_pnames;
+
+	++PNAMES(dir)->modified_count;
+}
+
 static VFILE *PnamesDirSaveSnapshot(void *_dir)
 {
 	struct pnames_dir *dir = _dir;
@@ -146,13 +163,16 @@ static void PnamesDirFree(void *dir)
 static const struct directory_funcs pnames_dir_funcs = {
 	"pname", "pnames",
 	PnamesDirRefresh,
+	NULL,  // refresh_changes
 	NULL,  // open
 	TX_LumpDirOpenDir,
 	PnamesDirRemove,
+	NULL,  // remove_entries
 	PnamesDirRename,
 	PnamesDirNeedCommit,
 	PnamesDirCommit,
 	PnamesDirSwapEntries,
+	PnamesDirPermuteEntries,
 	PnamesDirSaveSnapshot,
 	PnamesDirRestoreSnapshot,
 	PnamesDirFree,
@@ -179,7 +199,8 @@ static bool PnamesDirSave(void *_dir, struct directory *wad_dir,
 {
 	struct pnames_dir *dir = _dir;
 	struct wad_file *wf = VFS_WadFile(wad_dir);
-	VFILE *out, *marshaled;
+	VFILE *marshaled;
+	bool success;
 
 	if (PNAMES(dir)->modified_count == 0) {
 		return true;
@@ -188,16 +209,13 @@ static bool PnamesDirSave(void *_dir, struct directory *wad_dir,
 	marshaled = TX_MarshalPnames(PNAMES(dir));
 	assert(marshaled != NULL);
 
-	out = W_OpenLumpRewrite(wf, ent - wad_dir->entries);
-	if (out == NULL) {
-		vfclose(marshaled);
+	success = W_WriteLumpFrom(wf, ent - wad_dir->entries, marshaled);
+	vfclose(marshaled);
+	if (!success) {
+		VFS_Rollback(wad_dir);
 		return false;
 	}
 
-	vfcopy(marshaled, out);
-	vfclose(marshaled);
-	vfclose(out);
-
 	VFS_CommitChanges(wad_dir, "update of '%s'", ent->name);
 	UI_ShowNotice("%s lump updated.", ent->name);
 
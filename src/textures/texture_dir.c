@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
@@ -49,9 +50,8 @@ static void TextureDirRefresh(void *_dir, struct directory_entry **entries,
 	for (i = 0; i < TEXTURES(dir)->num_textures; i++) {
 		struct directory_entry *ent = *entries + i;
 		ent->type = FILE_TYPE_TEXTURE;
-		ent->name = checked_calloc(9, 1);
-		memcpy(ent->name, TEXTURES(dir)->textures[i]->name, 8);
-		ent->name[8] = '\0';
+		ent->name = VFS_AllocEntryName(
+			&dir->dir.dir, TEXTURES(dir)->textures[i]->name, 8);
 		ent->size = 0;
 		ent->serial_no = TEXTURES(dir)->serial_nos[i];
 	}
@@ -115,6 +115,31 @@ static void TextureDirSwap(void *_dir, unsigned int x, unsigned int y)
 	++TEXTURES(dir)->modified_count;
 }
 
+static void TextureDirPermute(void *_dir, const unsigned int *order)
+{
+	struct texture_dir *dir = _dir;
+	struct textures *txs = TEXTURES(dir);
+	struct texture **new_textures;
+	uint64_t *new_serial_nos;
+	unsigned int i;
+
+	new_textures = checked_calloc(txs->num_textures + 1,
+	                              sizeof(struct texture *));
+	new_serial_nos = checked_calloc(txs->num_textures + 1,
+	                                sizeof(uint64_t));
+	for (i = 0; i < txs->num_textures; i++) {
+		assert(order[i] < txs->num_textures);
+		new_textures[i] = txs->textures[order[i]];
+		new_serial_nos[i] = txs->serial_nos[order[i]];
+	}
+	free(txs->textures);
+	free(txs->serial_nos);
+	txs->textures = new_textures;
+	txs->serial_nos = new_serial_nos;
+
+	++txs->modified_count;
+}
+
 static VFILE *TextureDirSaveSnapshot(void *_dir)
 {
 	struct texture_dir *dir = _dir;
@@ -154,13 +179,16 @@ static void TextureDirFree(void *dir)
 struct directory_funcs texture_dir_funcs = {
 	"texture", "textures",
 	TextureDirRefresh,
+	NULL,  // refresh_changes
 	TextureDirOpen,
 	TX_LumpDirOpenDir,
 	TextureDirRemove,
+	NULL,  // remove_entries
 	TextureDirRename,
 	TextureDirNeedCommit,
 	TextureDirCommit,
 	TextureDirSwap,
+	TextureDirPermute,
 	TextureDirSaveSnapshot,
 	TextureDirRestoreSnapshot,
 	TextureDirFree,
@@ -238,7 +266,8 @@ static bool TextureDirSave(void *_dir, struct directory *wad_dir,
 {
 	struct texture_dir *dir = _dir;
 	struct wad_file *wf;
-	VFILE *out, *texture_out;
+	VFILE *texture_out;
+	bool success;
 
 	// Unchanged since it was opened?
 	if (TEXTURES(dir)->modified_count == 0) {
@@ -256,15 +285,13 @@ static bool TextureDirSave(void *_dir, struct directory *wad_dir,
 
 	wf = VFS_WadFile(wad_dir);
 	assert(wf != NULL);
-	out = W_OpenLumpRewrite(wf, ent - wad_dir->entries);
-	if (out == NULL) {
-		vfclose(texture_out);
+	success = W_WriteLumpFrom(wf, ent - wad_dir->entries, texture_out);
+	vfclose(texture_out);
+	if (!success) {
+		VFS_Rollback(wad_dir);
+		ConversionError("Error writing '%s' lump.", ent->name);
 		return false;
 	}
-
-	vfcopy(texture_out, out);
-	vfclose(texture_out);
-	vfclose(out);
 	VFS_CommitChanges(wad_dir, "update of '%s' texture directory",
 	                  ent->name);
 	UI_ShowNotice("%s lump updated.", ent->name);
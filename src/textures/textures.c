@@ -134,13 +134,12 @@ struct textures *TX_NewTextureList(int num_textures)
 struct textures *TX_UnmarshalTextures(VFILE *input)
 {
 	struct textures *result = NULL;
-	uint8_t *lump;
+	const uint8_t *lump;
 	size_t lump_len, min_len;
 	uint32_t num_textures;
 	int i;
 
-	lump = vfreadall(input, &lump_len);
-	vfclose(input);
+	lump = vfborrow(input, &lump_len);
 	if (lump_len < 4) {
 		ConversionError("Failed to read 4 byte lump header.");
 		goto fail;
@@ -186,7 +185,7 @@ struct textures *TX_UnmarshalTextures(VFILE *input)
 	TX_AddSerialNos(result);
 
 fail:
-	free(lump);
+	vfclose(input);
 	return result;
 }
 
@@ -13,6 +13,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
+
 #include "common.h"
 #include "ui/actions_bar.h"
 #include "ui/colors.h"
@@ -27,6 +32,9 @@ void UI_RecalculateStacks(void);
 
 static struct pane *actions_bar, *title_bar;
 static bool main_loop_exited = false;
+static int main_loop_depth = 0;
+static int watch_fd = -1;
+static void (*watch_callback)(void) = NULL;
 
 void UI_PaneKeypress(void *pane, int key)
 {
@@ -200,9 +208,55 @@ static bool HandleKeypress(void)
 	return true;
 }
 
+bool UI_WaitForInput(int fd)
+{
+#ifndef _WIN32
+	struct pollfd fds[2];
+	int key;
+
+	if (fd < 0) {
+		return true;
+	}
+
+	// curses may already have read input that poll() won't see.
+	nodelay(stdscr, 1);
+	key = getch();
+	if (key != ERR) {
+		ungetch(key);
+		return true;
+	}
+
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = fd;
+	fds[1].events = POLLIN;
+	if (poll(fds, 2, -1) < 0) {
+		// Interrupted, probably by SIGWINCH; let curses look.
+		return true;
+	}
+	return (fds[1].revents & POLLIN) == 0;
+#else
+	return true;
+#endif
+}
+
+void UI_SetWatchHandler(int fd, void (*callback)(void))
+{
+	watch_fd = fd;
+	watch_callback = callback;
+}
+
 static void HandleKeypresses(void)
 {
-	// Block on the first keypress.
+	// Block on the first keypress. At the top level only, we also
+	// handle changes to watched files while waiting; nested loops
+	// (dialogs, pagers) may be holding on to directory entries.
+	if (main_loop_depth == 1 && watch_callback != NULL) {
+		while (!UI_WaitForInput(watch_fd)) {
+			watch_callback();
+			UI_DrawAllPanes();
+		}
+	}
 	nodelay(stdscr, 0);
 	HandleKeypress();
 
@@ -218,12 +272,14 @@ static void HandleKeypresses(void)
 
 void UI_RunMainLoop(void)
 {
+	++main_loop_depth;
 	while (!main_loop_exited) {
 		UI_DrawAllPanes();
 		HandleKeypresses();
 	}
 
 	main_loop_exited = false;
+	--main_loop_depth;
 }
 
 void UI_ExitMainLoop(void)
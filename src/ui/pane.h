@@ -30,6 +30,12 @@ void UI_RaisePaneToTop(void *pane);
 void UI_PaneKeypress(void *pane, int key);
 void UI_StackKeypress(struct pane_stack *s, int key);
 void UI_InputKeypress(int key);
+// Blocks until there is a keypress waiting, or until the given file
+// descriptor becomes readable. Returns true if there is a keypress.
+bool UI_WaitForInput(int fd);
+// While the main loop is waiting for a keypress, the callback is invoked
+// whenever fd becomes readable.
+void UI_SetWatchHandler(int fd, void (*callback)(void));
 void UI_RunMainLoop(void);
 void UI_ExitMainLoop(void);
 void UI_Init(void);
@@ -361,7 +361,7 @@ static char *TempExport(struct temp_edit_context *ctx, struct directory *from,
 	ctx->temp_dir = mkdtemp(ctx->temp_dir);
 
 	ctx->lumpnum = ent - from->entries;
-	ctx->lt = LI_IdentifyLump(VFS_WadFile(from), ctx->lumpnum);
+	ctx->lt = LI_IdentifyLumpDeep(VFS_WadFile(from), ctx->lumpnum);
 	// TODO: If lt == &lump_type_level, export the whole level to a
 	// temp file so we can edit it in a level editor.
 
@@ -411,10 +411,18 @@ static bool WaitForEdit(struct temp_edit_context *ctx)
 	// continue to silently keep checking in the background to see if the file
 	// changes. As soon as the user presses a key we give up and stop, but
 	// if the file does get changed in the background we can still take the
-	// opportunity to prompt.
+	// opportunity to prompt. Where we can watch the temp directory we
+	// sleep until something happens in it; otherwise we poll.
+	int watch = VFS_WatchPath(ctx->temp_dir);
+
 	timeout(100);
 	while (!TempFileChanged(ctx)) {
-		int c = getch();
+		int c;
+		if (watch >= 0 && !UI_WaitForInput(VFS_WatchFd())) {
+			VFS_PollWatches();
+			continue;
+		}
+		c = getch();
 		if (c != ERR) {
 			ungetch(c);
 			RedrawScreen();
@@ -423,6 +431,7 @@ static bool WaitForEdit(struct temp_edit_context *ctx)
 		}
 	}
 	timeout(-1);
+	VFS_Unwatch(watch);
 
 	return result;
 }